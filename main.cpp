@@ -3,13 +3,71 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <malloc.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
 
 #define COLUMN_USERNAME_SIZE    32
 #define COLUMN_EMAIL_SIZE       255
-#define TABLE_MAX_PAGES         100   // arbitrary 
+#define DEFAULT_POOL_FRAMES     256   // frames in the buffer pool unless -frames is given
+#define MIN_POOL_FRAMES         (ROW_MAX_DIRTY_PAGES + POOL_PIN_RESERVE) // see pager_commit_due
+#define MAX_POOL_FRAMES         (1 << 24) // keeps the page table, twice the frames, within 32 bits
+#define DEFAULT_PAGE_SIZE       4096  // pages of a new file unless -page-size is given
+#define MIN_PAGE_SIZE           4096
+#define MAX_PAGE_SIZE           65536 // leaf values are found by 16-bit offsets
+#define LEGACY_PAGE_SIZE        4096  // pages of files written before the header existed
+#define INVALID_PAGE_NUM        UINT32_MAX
+#define INVALID_FRAME           UINT32_MAX
+#define MMAP_RESERVE_SIZE       (1ULL << 36)  // address space set aside for the file in mmap mode
+#define MMAP_GROW_PAGES         256           // pages added to the file each time the mapping fills up
+#define DEFAULT_READAHEAD_PAGES 32            // leaves prefetched ahead of a scan unless -readahead is given
+#define MAX_READAHEAD_PAGES     1024          // upper bound of -readahead
+#define READAHEAD_TRIGGER       2             // sibling hops in a row before a cursor counts as a scan
+#define WAL_GROUP_COMMIT        32            // commits per fsync of the log unless -group-commit is given
+#define MAX_WAL_GROUP_COMMIT    (1 << 20)     // upper bound of -group-commit
+#define WAL_SYNC_INTERVAL_USEC  10000         // a commit group is also synced once it is this old
+#define WAL_CHECKPOINT_BYTES    (16 << 20)    // checkpoint once the log grows past this
+#define WAL_LSN_PENDING         UINT64_MAX    // page changed by the statement still running
+#define RESULT_SINK_BUFFER_SIZE (64 * 1024)   // select output collected per write()
+#define RESULT_SINK_HELD        -1            // fd of a sink that keeps its output for later
+#define RESULT_SINK_WRITER      -2            // fd of a sink that hands its output to a function
+#define DEFAULT_SCAN_THREADS    1             // workers of a full-table select unless -scan-threads is given
+#define MAX_SCAN_THREADS        256
+#define SCAN_RANGES_PER_THREAD  8             // key ranges a parallel scan splits into per worker
+#define SCAN_HELD_BUFFERS       4             // result buffers a parallel scan holds per worker ahead of the output
+#define BATCH_CHUNK_SIZE        (1 << 20)     // bytes of input read at a time by -batch
+#define BATCH_COMMIT_STATEMENTS 1000          // statements sharing one commit in -batch mode
+#define SNAPSHOT_MAX_PAGES      8             // pages a reader may hold at once
+#define ARENA_BLOCK_SIZE        (64 * 1024)   // bytes a statement arena grows by, see "Statement arena"
+#define SERVER_MAX_REQUEST      (1 << 20)     // longest statement a client may send
+#define SERVER_MAX_PENDING      (4 << 20)     // reply bytes queued before a client is read no further
+#define SERVER_MAX_REPLY        (1 << 30)     // longest select result sent back in one reply
+#define SERVER_READ_SIZE        (64 * 1024)   // bytes read from a client at a time
+#define SERVER_MAX_EVENTS       64            // epoll events handled per wakeup
+#define BENCH_SCANS             5             // full scans timed by -bench
 #define size_of_attribute(Struct, Attribute) sizeof(((Struct*)0)->Attribute)
 
 typedef struct {
@@ -18,7 +76,7 @@ typedef struct {
     char email[COLUMN_EMAIL_SIZE + 1];
 } Row;
 
-const uint32_t PAGE_SIZE       =    4096;
+uint32_t PAGE_SIZE             =    DEFAULT_PAGE_SIZE;  // of the open file, see page_layout_init
 const uint32_t ID_SIZE         =    size_of_attribute(Row, id);
 const uint32_t USERNAME_SIZE   =    size_of_attribute(Row, username);
 const uint32_t EMAIL_SIZE      =    size_of_attribute(Row, email);
@@ -28,10 +86,28 @@ const uint32_t EMAIL_OFFSET    =    USERNAME_OFFSET + USERNAME_SIZE;
 const uint32_t ROW_SIZE        =    ID_SIZE + USERNAME_SIZE + EMAIL_SIZE;
 
 
+typedef enum {
+    COLUMN_ID,
+    COLUMN_USERNAME,
+    COLUMN_EMAIL
+} Column;
+#define COLUMN_BIT(column)      (1u << (column))
+#define ALL_COLUMNS             (COLUMN_BIT(COLUMN_ID) | COLUMN_BIT(COLUMN_USERNAME) | COLUMN_BIT(COLUMN_EMAIL))
+
+// How select writes rows, set with .mode
+typedef enum {
+    OUTPUT_TEXT,    // (id, username, email)
+    OUTPUT_CSV,     // id,username,email
+    OUTPUT_BINARY   // u32 id, then u8 length and bytes of username and of email
+} OutputFormat;
+
 typedef enum {
     STATEMENT_INSERT,
-    STATEMENT_SELECT
+    STATEMENT_SELECT,
+    STATEMENT_CREATE_INDEX,
+    STATEMENT_DELETE
 } StatementType;
+#define NUM_STATEMENT_TYPES     (STATEMENT_DELETE + 1)
 
 
 typedef struct {
@@ -41,32 +117,231 @@ typedef struct {
 } InputBuffer;
 
 
+// The comparisons a where on id can make
+typedef enum {
+    ID_EQUAL,
+    ID_LESS,
+    ID_LESS_EQUAL,
+    ID_GREATER,
+    ID_GREATER_EQUAL,
+    ID_BETWEEN
+} IdComparison;
+
+// What a ? placeholder stands for, see "Prepared statements"
+typedef enum {
+    PARAM_ID,           // of rows_to_insert[row]
+    PARAM_USERNAME,
+    PARAM_EMAIL,
+    PARAM_WHERE_VALUE,  // where_value, or where_args[0] for a where on id
+    PARAM_WHERE_HIGH    // where_args[1] of between
+} ParamTarget;
+
+typedef struct {
+    ParamTarget target;
+    uint32_t row;
+} Param;
+
 typedef struct {
     StatementType type;
     Row row_to_insert;  // only used by insert statement
+    Row* rows_to_insert;    // every row of the insert; points at row_to_insert for a single row
+    uint32_t num_rows;
+    bool has_where;         // select ... where where_column = where_value
+    Column where_column;
+    char where_value[COLUMN_EMAIL_SIZE + 1];
+    uint32_t columns;       // a bit for each Column select prints
+    IdComparison where_op;
+    uint32_t where_args[2]; // the values compared to, the second one for between only
+    uint32_t where_low;     // the id range of a where on id, inclusive
+    uint32_t where_high;
+    Column index_column;    // create index on index_column
+    Param* params;          // one for each ?, in order
+    uint32_t num_params;
 } Statement;
 
+/**
+ * A frame is one slot of the buffer pool.
+ * It holds the in-memory copy of a single page plus the bookkeeping
+ * needed to decide when that page may be evicted.
+ * */
+struct Frame_t {
+    uint32_t page_num;      // INVALID_PAGE_NUM while the frame is free
+    uint32_t pin_count;     // a pinned frame is never evicted
+    bool referenced;        // CLOCK second-chance bit
+    bool dirty;             // page differs from its copy on disk
+    uint64_t wal_lsn;       // end of the log record holding this page's latest image
+    void* data;
+    uint64_t version;       // first snapshot that sees data, see "Snapshots"
+    pthread_rwlock_t latch; // shared while a reader copies the page, exclusive while it is read in
+};
+typedef struct Frame_t Frame;
+
+/**
+ * An earlier image of a page, kept for the snapshots in [begin, end).
+ * */
+struct PageVersion_t {
+    uint32_t page_num;
+    uint64_t begin;
+    uint64_t end;
+    void* data;
+    struct PageVersion_t* next; // in the same bucket of Pager.versions
+};
+typedef struct PageVersion_t PageVersion;
+
+/**
+ * Write-ahead log, kept next to the db file as <filename>-wal.
+ * Each statement that changes pages is a commit: one page record per modified page
+ * (a header followed by the full page image) and a closing commit record,
+ * appended with a single write. The log is fsynced once per group of commits,
+ * by the committing thread when the group is full or by a background thread
+ * when it has waited WAL_SYNC_INTERVAL_USEC, and a page is only written to the db file after its log record is on disk.
+ * On open, every complete commit found in the log is replayed into the db file.
+ * */
+typedef enum {
+    WAL_RECORD_PAGE = 1,
+    WAL_RECORD_COMMIT = 2
+} WalRecordType;
+
+typedef struct {
+    uint32_t type;
+    uint32_t page_num;      // page records: page the image belongs to; commit records: pages in the db
+    uint32_t page_size;     // of the db, 0 in logs written before the page size could change
+    uint32_t checksum;      // chained over every record since the start of the log
+} WalRecordHeader;
+
+struct Wal_t {
+    int file_descriptor;
+    char* filename;
+    uint64_t file_length;   // log sequence numbers are byte offsets into the log
+    uint64_t synced_length; // also read without the mutex, by eviction
+    uint32_t checksum;      // checksum of the last record written
+    uint32_t group_commit;
+    uint32_t unsynced_commits;
+    uint64_t first_unsynced_usec;
+    pthread_t syncer;       // syncs a group once its first commit is WAL_SYNC_INTERVAL_USEC old
+    pthread_cond_t unsynced; // wakes the syncer when a group starts, and on close
+    bool closing;
+
+    uint32_t* pending;      // pages modified by the running statement, may hold duplicates
+    uint32_t num_pending;
+    uint32_t pending_capacity;
+    pthread_mutex_t mutex;  // held while appending, syncing or truncating
+};
+typedef struct Wal_t Wal;
+
+/**
+ * Counters of a database file and its trees, shown by .stats. Whichever thread
+ * does the work bumps them with stats_add, so reading them all at once is not
+ * a consistent snapshot. Latency bucket 0 counts statements under 1 us,
+ * bucket i those from 2^(i-1) us up to 2^i us, and the last one everything
+ * slower.
+ **/
+#define STATS_LATENCY_BUCKETS   24
+typedef struct {
+    uint64_t page_hits;         // get_page found the page in the buffer pool, every call in mmap mode
+    uint64_t page_misses;       // ... and had to read it in
+    uint64_t pages_read;        // from the db file, not counting mmap page faults
+    uint64_t pages_written;     // to the db file
+    uint64_t pages_logged;      // page images appended to the log
+    uint64_t commits;
+    uint64_t checkpoints;
+    uint64_t leaf_splits;       // of the table and of the indexes
+    uint64_t internal_splits;
+    uint64_t root_splits;       // each one adds a level to a tree
+    uint64_t merges;            // nodes merged into a neighbour by deletes
+    uint64_t statements[NUM_STATEMENT_TYPES];
+    uint64_t latency[NUM_STATEMENT_TYPES][STATS_LATENCY_BUCKETS];
+} Stats;
+
 /**
  * Store rows in blocks of memory called pages
  * Each page stores as many rows as it can fit
  * Rows are serialized into a compact representation with each page
  * Pages are only allocated as needed
- * Keep a fixed-size array of pointers to pages
+ * Pages are cached in a fixed number of frames (the buffer pool),
+ * and a page that is not pinned can be evicted to make room for another one.
+ * page_table maps page numbers to frames (open addressing, linear probing).
+ *
+ * In mmap mode there are no frames: the file is mapped privately and get_page
+ * returns pointers straight into the mapping. Modified pages stay private to
+ * the process (copy-on-write) until a flush writes them back with pwrite.
+ *
+ * mutex guards the pool's bookkeeping (frames, page_table, clock_hand and
+ * num_pages) and the snapshots, never the contents of the pages, which have
+ * latches of their own.
  * */
 struct Pager_t {
     int file_descriptor;
-    uint32_t file_length;
+    uint64_t file_length;
     uint32_t num_pages;
-    void* pages[TABLE_MAX_PAGES];
+    uint32_t num_frames;
+    Frame* frames;
+    uint32_t clock_hand;
+    uint32_t* page_table;
+    uint32_t page_table_mask;
+    pthread_mutex_t mutex;
+    uint64_t version;       // rows published by the writer so far
+    bool unpublished;       // the writer has changed pages since the last publish
+    bool versioned;         // ... and kept their earlier images for the running snapshots
+    pthread_cond_t published;
+    uint64_t* snapshots;    // versions seen by the running readers, oldest first
+    uint32_t num_snapshots;
+    uint32_t snapshots_capacity;
+    PageVersion** versions; // earlier page images, as many chains as page_table has slots
+    uint32_t num_versions;
+
+    bool use_mmap;
+    void* map;              // MMAP_RESERVE_SIZE bytes, only the first map_pages are backed by the file
+    uint32_t map_pages;
+    uint8_t* map_dirty;     // one bit per page in the mapping
+    uint8_t* map_checked;   // ... and one per page whose checksum was verified
+
+    uint32_t format_version;    // FILE_FORMAT_ of the file
+    bool checksums;             // pages end in a checksum, see "Page checksums"
+    Wal* wal;               // NULL when running without a log
+    bool skip_wal;          // set while a bulk load writes pages nothing points to yet
+    uint32_t readahead_pages;
+
+    Stats stats;
 };
 typedef struct Pager_t Pager;
 
+/**
+ * Options for opening a database, picked up from the command line.
+ * */
+typedef struct {
+    uint32_t num_frames;    // buffer pool size, unused in mmap mode
+    uint32_t page_size;     // of a new file, an existing one keeps its own
+    bool use_mmap;
+    bool use_wal;
+    uint32_t wal_group_commit;
+    uint32_t readahead_pages;   // 0 turns read-ahead off
+} PagerConfig;
+
+/**
+ * A secondary index is a B+tree of its own, see "Secondary indexes".
+ **/
+#define TABLE_MAX_INDEXES       2   // one for each string column
+typedef struct {
+    Column column;
+    uint32_t root_page_num;
+} Index;
+
 /**
  * Table structure that points to pages of rows and keeps track of how many rows there are.
  * */
 struct Table_t {
     uint32_t root_page_num;
     Pager* pager;
+    uint32_t num_indexes;
+    Index indexes[TABLE_MAX_INDEXES];
+    OutputFormat output_format;
+    int output_fd;      // where select writes, standard output unless .output is given
+    uint32_t commit_interval;           // statements per commit, 1 unless -batch is given
+    uint32_t uncommitted_statements;
+    uint32_t scan_threads;              // workers of a full-table select, see "Parallel scans"
+    pthread_rwlock_t latch;             // see table_begin_read
+    pthread_mutex_t write_mutex;
 };
 typedef struct Table_t Table;
 
@@ -87,6 +362,10 @@ struct Cursor_t{
     uint32_t page_num;
     uint32_t cell_num;
     bool end_of_table;  // a position past the end of a table
+    uint32_t end_key;   // or past this key, for a range scan
+    uint32_t sequential_leaves;     // leaves entered through sibling links in a row
+    uint32_t readahead_remaining;   // leaves ahead of the cursor that were already prefetched
+    void* node;         // the leaf, pinned until the cursor moves on
 };
 typedef struct Cursor_t Cursor;
 
@@ -95,7 +374,8 @@ typedef struct Cursor_t Cursor;
 enum ExecuteResult_t{ 
     EXECUTE_SUCCESS, 
     EXECUTE_DUPLICATE_KEY,
-    EXECUTE_TABLE_FULL 
+    EXECUTE_TABLE_FULL,
+    EXECUTE_INDEX_EXISTS
 };
 typedef enum ExecuteResult_t ExecuteResult; 
 
@@ -124,53 +404,250 @@ const uint32_t NODE_TYPE_SIZE             = sizeof(uint8_t);
 const uint32_t NODE_TYPE_OFFSET           = 0;
 const uint32_t IS_ROOT_SIZE               = sizeof(uint8_t);
 const uint32_t IS_ROOT_OFFSET             = NODE_TYPE_SIZE;
-const uint32_t PARENT_POINTER_SIZE        = sizeof(uint32_t);
-const uint32_t PARENT_POINTER_OFFSET      = IS_ROOT_OFFSET + IS_ROOT_SIZE;
-const uint32_t COMMON_NODE_HEADER_SIZE    = NODE_TYPE_SIZE + IS_ROOT_SIZE + PARENT_POINTER_OFFSET;
+// Nodes keep no parent pointer: a split finds its parents on the root-to-leaf path,
+// so it never has to rewrite the children it moves. The format byte tells apart
+// layouts written by older versions (those have a zero there), and the spare
+// byte belongs to the node type.
+const uint32_t NODE_FORMAT_SIZE           = sizeof(uint8_t);
+const uint32_t NODE_FORMAT_OFFSET         = IS_ROOT_OFFSET + IS_ROOT_SIZE;
+const uint32_t NODE_SPARE_SIZE            = sizeof(uint8_t);
+const uint32_t NODE_SPARE_OFFSET          = NODE_FORMAT_OFFSET + NODE_FORMAT_SIZE;
+const uint32_t COMMON_NODE_HEADER_SIZE    = NODE_TYPE_SIZE + IS_ROOT_SIZE + NODE_FORMAT_SIZE +
+                                            NODE_SPARE_SIZE;
+
+/**
+ * Page Layout
+ * The page size is picked when a file is created, a power of two from
+ * MIN_PAGE_SIZE to MAX_PAGE_SIZE: larger pages give internal nodes more
+ * children and scans longer sequential reads. Pages of files with checksums
+ * end in the CRC32C of the rest of the page (see "Page checksums"), and nodes
+ * only use the bytes before it. Both sizes depend on the file, so they and the
+ * sizes derived from them below are set by page_layout_init when the file is
+ * opened.
+ **/
+const uint32_t PAGE_CHECKSUM_SIZE         = sizeof(uint32_t);
+uint32_t PAGE_USABLE_SIZE                 = PAGE_SIZE - PAGE_CHECKSUM_SIZE;
 
 /**
  * Leaf Node Header Layout
+ * Leaves are slotted pages. The keys follow the header as a dense sorted array,
+ * so a search touches only a few cache lines, then come the 2-byte offsets of
+ * the values in the same order. The values are packed from the end of the page
+ * towards them: the row's strings, each prefixed with its length, so a row
+ * takes only the bytes it uses.
  **/
+#define LEAF_FORMAT_FIXED         0   // fixed-size cells of key and Row
+#define LEAF_FORMAT_SLOTTED       1   // slotted, with the key at the start of each cell
+#define LEAF_FORMAT_KEY_ARRAY     2   // slotted, keys in their own array
+#define LEAF_SEARCH_WINDOW        16  // a search narrows down to this many keys, then counts them
 const uint32_t LEAF_NODE_NUM_CELLS_SIZE   = sizeof(uint32_t);
 const uint32_t LEAF_NODE_NUM_CELLS_OFFSET = COMMON_NODE_HEADER_SIZE;
-const uint32_t LEAF_NODE_HEADER_SIZE      = COMMON_NODE_HEADER_SIZE + LEAF_NODE_NUM_CELLS_SIZE;
+const uint32_t LEAF_NODE_NEXT_LEAF_SIZE   = sizeof(uint32_t);   // 0 means no sibling to the right
+const uint32_t LEAF_NODE_NEXT_LEAF_OFFSET = LEAF_NODE_NUM_CELLS_OFFSET + LEAF_NODE_NUM_CELLS_SIZE;
+const uint32_t LEAF_NODE_CONTENT_START_SIZE   = sizeof(uint16_t);   // lowest value offset
+const uint32_t LEAF_NODE_CONTENT_START_OFFSET = LEAF_NODE_NEXT_LEAF_OFFSET + LEAF_NODE_NEXT_LEAF_SIZE;
+const uint32_t LEAF_NODE_FRAGMENTED_SIZE      = sizeof(uint16_t);   // bytes of dead values in the value area
+const uint32_t LEAF_NODE_FRAGMENTED_OFFSET    = LEAF_NODE_CONTENT_START_OFFSET + LEAF_NODE_CONTENT_START_SIZE;
+const uint32_t LEAF_NODE_HEADER_SIZE      = LEAF_NODE_FRAGMENTED_OFFSET + LEAF_NODE_FRAGMENTED_SIZE;
 
 /**
  * Leaf Node Body Layout
  **/
+const uint32_t LEAF_NODE_SLOT_SIZE        = sizeof(uint16_t);
 const uint32_t LEAF_NODE_KEY_SIZE         = sizeof(uint32_t);
-const uint32_t LEAF_NODE_KEY_OFFSET       = 0;
-const uint32_t LEAF_NODE_VALUE_SIZE       = ROW_SIZE;
-const uint32_t LEAF_NODE_VALUE_OFFSET     = LEAF_NODE_KEY_OFFSET + LEAF_NODE_KEY_SIZE;
-const uint32_t LEAF_NODE_CELL_SIZE        = LEAF_NODE_KEY_SIZE + LEAF_NODE_VALUE_SIZE;
-const uint32_t LEAF_NODE_SPACE_FOR_CELLS  = PAGE_SIZE - LEAF_NODE_HEADER_SIZE;
-const uint32_t LEAF_NODE_MAX_CELLS        = LEAF_NODE_SPACE_FOR_CELLS / LEAF_NODE_CELL_SIZE;
-
+const uint32_t LEAF_NODE_MAX_VALUE_SIZE   = 2 * sizeof(uint8_t) + COLUMN_USERNAME_SIZE + COLUMN_EMAIL_SIZE;
+const uint32_t LEAF_NODE_MAX_CELL_SIZE    = LEAF_NODE_KEY_SIZE + LEAF_NODE_MAX_VALUE_SIZE;
+uint32_t LEAF_NODE_SPACE_FOR_CELLS        = PAGE_USABLE_SIZE - LEAF_NODE_HEADER_SIZE;
 
 /**
- * Leaf node sizes 
+ * Leaves written in an older format are converted when read in, and reach the
+ * file in the current one the next time they are modified. Fixed-size leaves
+ * have a zero format byte and hold cells of the key and the whole Row right
+ * after num_cells and next_leaf.
  **/
-const uint32_t LEAF_NODE_RIGHT_SPLIT_COUNT= (LEAF_NODE_MAX_CELLS + 1) / 2;
-const uint32_t LEAF_NODE_LEFT_SPLIT_COUNT = (LEAF_NODE_MAX_CELLS + 1) - LEAF_NODE_RIGHT_SPLIT_COUNT;
+const uint32_t LEGACY_LEAF_NODE_HEADER_SIZE = COMMON_NODE_HEADER_SIZE + LEAF_NODE_NUM_CELLS_SIZE +
+                                              LEAF_NODE_NEXT_LEAF_SIZE;
+const uint32_t LEGACY_LEAF_NODE_CELL_SIZE   = LEAF_NODE_KEY_SIZE + ROW_SIZE;
+const uint32_t LEGACY_LEAF_NODE_MAX_CELLS   = (LEGACY_PAGE_SIZE - LEGACY_LEAF_NODE_HEADER_SIZE) /
+                                              LEGACY_LEAF_NODE_CELL_SIZE;
 
 /**
  * Internal Node Header Layout
+ * Keys are 64 bits wide but stored compressed: the node keeps its smallest key
+ * as a base, with the high bytes all its keys share, and each key as the
+ * difference to it in the fewest bytes (1, 2, 4 or 8) that fit the node's
+ * range. The deltas have one width per node, so they stay a plain array that
+ * can be binary searched. Dense 32-bit ids need 2 bytes a key, which gives
+ * about 680 children a node instead of 510, and wider keys cost little as
+ * long as neighbours are close.
  **/
+#define INTERNAL_FORMAT_PLAIN     0   // 8-byte cells of child and 32-bit key
+#define INTERNAL_FORMAT_DELTA     3   // past every leaf format, see internal_node_is_plain
+const uint32_t INTERNAL_NODE_KEY_WIDTH_OFFSET          = NODE_SPARE_OFFSET;
 const uint32_t INTERNAL_NODE_NUM_KEYS_SIZE             = sizeof(uint32_t);
 const uint32_t INTERNAL_NODE_NUM_KEYS_OFFSET           = COMMON_NODE_HEADER_SIZE;
 const uint32_t INTERNAL_NODE_RIGHT_CHILD_SIZE          = sizeof(uint32_t);
 const uint32_t INTERNAL_NODE_RIGHT_CHILD_OFFSET        = INTERNAL_NODE_NUM_KEYS_OFFSET + INTERNAL_NODE_NUM_KEYS_SIZE;
-const uint32_t INTERNAL_NODE_HEADER_SIZE               = COMMON_NODE_HEADER_SIZE + 
-                                                         INTERNAL_NODE_NUM_KEYS_SIZE + 
-                                                         INTERNAL_NODE_RIGHT_CHILD_SIZE;
+const uint32_t INTERNAL_NODE_KEY_BASE_SIZE             = sizeof(uint64_t);
+const uint32_t INTERNAL_NODE_KEY_BASE_OFFSET           = INTERNAL_NODE_RIGHT_CHILD_OFFSET + INTERNAL_NODE_RIGHT_CHILD_SIZE;
+const uint32_t INTERNAL_NODE_HEADER_SIZE               = INTERNAL_NODE_KEY_BASE_OFFSET + INTERNAL_NODE_KEY_BASE_SIZE;
 
 /**
  * Internal Node body Layout
+ * The key deltas follow the header, the children (but the right one) are
+ * stored from the end of the page backwards, so neither array has to move
+ * when the other one grows.
  **/
-const uint32_t INTERNAL_NODE_KEY_SIZE                  = sizeof(uint32_t);
 const uint32_t INTERNAL_NODE_CHILD_SIZE                = sizeof(uint32_t);
-const uint32_t INTERNAL_NODE_CELL_SIZE                 = INTERNAL_NODE_CHILD_SIZE + INTERNAL_NODE_KEY_SIZE;
+uint32_t INTERNAL_NODE_SPACE_FOR_CELLS                 = PAGE_USABLE_SIZE - INTERNAL_NODE_HEADER_SIZE;
+
+/**
+ * Index Leaf Layout
+ * Leaves of secondary indexes share the leaf header and hold nothing but
+ * sorted 64-bit entries.
+ **/
+#define LEAF_FORMAT_INDEX         4   // past INTERNAL_FORMAT_DELTA, no format value means two things
+const uint32_t INDEX_LEAF_HEADER_SIZE   = LEAF_NODE_NEXT_LEAF_OFFSET + LEAF_NODE_NEXT_LEAF_SIZE +
+                                          sizeof(uint32_t);  // padding, keeps the entries aligned
+const uint32_t INDEX_ENTRY_SIZE         = sizeof(uint64_t);
+uint32_t INDEX_LEAF_MAX_ENTRIES         = (PAGE_USABLE_SIZE - INDEX_LEAF_HEADER_SIZE) / INDEX_ENTRY_SIZE;
+
+/**
+ * Meta Page Layout
+ * Page 0 describes the file: where the table's root is, which secondary
+ * indexes exist, and the header pager_open checks before anything else: the
+ * magic, the format version and the page size. Its first byte is never a node
+ * type. Files written before the header existed have zeros in its place.
+ **/
+#define META_PAGE_NUM           0
+#define META_PAGE_MARKER        0x4D
+#define FILE_MAGIC              "MYBASEDB"  // 8 bytes, without the terminator
+#define FILE_MAGIC_SIZE         8
+#define FILE_FORMAT_UNCHECKED   1   // nodes span the whole page, no checksums
+#define FILE_FORMAT_CHECKSUMS   2   // pages end in a checksum, see "Page checksums"
+#define FILE_FORMAT_CURRENT     FILE_FORMAT_CHECKSUMS
+const uint32_t META_MARKER_OFFSET       = 0;
+const uint32_t META_TABLE_ROOT_OFFSET   = sizeof(uint32_t);
+const uint32_t META_NUM_INDEXES_OFFSET  = META_TABLE_ROOT_OFFSET + sizeof(uint32_t);
+const uint32_t META_INDEXES_OFFSET      = META_NUM_INDEXES_OFFSET + sizeof(uint32_t);
+const uint32_t META_INDEX_SIZE          = 2 * sizeof(uint32_t);  // column, root page
+const uint32_t META_FREELIST_OFFSET     = META_INDEXES_OFFSET + TABLE_MAX_INDEXES * META_INDEX_SIZE;
+const uint32_t META_FREE_PAGES_OFFSET   = META_FREELIST_OFFSET + sizeof(uint32_t);
+const uint32_t META_MAGIC_OFFSET        = META_FREE_PAGES_OFFSET + sizeof(uint32_t);
+const uint32_t META_FORMAT_OFFSET       = META_MAGIC_OFFSET + FILE_MAGIC_SIZE;
+const uint32_t META_PAGE_SIZE_OFFSET    = META_FORMAT_OFFSET + sizeof(uint32_t);
+
+/**
+ * Free Page Layout
+ * A page no tree uses any more is a link in the free list.
+ **/
+#define FREE_PAGE_MARKER        0x46  // first byte of a free page, never a node type
+const uint32_t FREE_PAGE_MARKER_OFFSET  = 0;
+const uint32_t FREE_PAGE_NEXT_OFFSET    = sizeof(uint32_t);  // 0 ends the list: page 0 is never free
+
+// The layout of plain internal nodes, converted when read in
+const uint32_t PLAIN_INTERNAL_NODE_HEADER_SIZE         = INTERNAL_NODE_RIGHT_CHILD_OFFSET + INTERNAL_NODE_RIGHT_CHILD_SIZE;
+const uint32_t PLAIN_INTERNAL_NODE_CELL_SIZE           = INTERNAL_NODE_CHILD_SIZE + sizeof(uint32_t);
+
+#define BTREE_MAX_HEIGHT        32    // internal levels a root-to-leaf path may pass through
+
+/**
+ * The most pages one row can change, all of which stay in the buffer pool
+ * until the next commit. Inserting a row may split every node on its path
+ * in the table and in each index, two pages a level, and the new root takes
+ * one more page. Deleting one may rebalance two siblings a level and free the
+ * child of a collapsing root. Both may change the meta page.
+ **/
+#define ROW_MAX_DIRTY_PAGES     ((TABLE_MAX_INDEXES + 1) * (2 * (BTREE_MAX_HEIGHT + 1) + 2) + 1)
+#define POOL_PIN_RESERVE        16    // frames left for pages pinned but not changed, by the writer or readers
+#define BULK_LOAD_FILL_FACTOR   0.9   // share of each node a bulk load fills, leaving room for inserts
+#define BULK_LOAD_FLUSH_PAGES   1024  // a bulk load writes its pages out in batches of this many
+
+
+// Row methods
+// Rows are stored as the username and the email, each prefixed with a length byte.
+// The id is the key of the cell and is not repeated.
+uint32_t row_value_size(Row* row) {
+    return 2 * sizeof(uint8_t) + strlen(row->username) + strlen(row->email);
+}
+
+void serialize_row(Row* source, void* destination) {
+    uint8_t username_length = strlen(source->username);
+    uint8_t email_length = strlen(source->email);
+    *(uint8_t*)destination = username_length;
+    memcpy(destination + 1, source->username, username_length);
+    *(uint8_t*)(destination + 1 + username_length) = email_length;
+    memcpy(destination + 2 + username_length, source->email, email_length);
+}
 
+void deserialize_row(uint32_t key, void* source, Row* destination) {
+    uint8_t username_length = *(uint8_t*)source;
+    uint8_t email_length = *(uint8_t*)(source + 1 + username_length);
+    destination->id = key;
+    memcpy(destination->username, source + 1, username_length);
+    destination->username[username_length] = '\0';
+    memcpy(destination->email, source + 2 + username_length, email_length);
+    destination->email[email_length] = '\0';
+}
+
+/**
+ * A row read in place: the strings point into the page and are not
+ * NUL-terminated, so a view is only good while that page stays pinned.
+ **/
+typedef struct {
+    uint32_t id;
+    const char* username;
+    uint8_t username_length;
+    const char* email;
+    uint8_t email_length;
+} RowView;
+
+void row_view(uint32_t key, void* source, RowView* view) {
+    view->id = key;
+    view->username_length = *(uint8_t*)source;
+    view->username = (const char*)(source + 1);
+    view->email_length = *(uint8_t*)(source + 1 + view->username_length);
+    view->email = (const char*)(source + 2 + view->username_length);
+}
+
+const char* column_name(Column column) {
+    switch (column) {
+        case (COLUMN_ID):
+            return "id";
+        case (COLUMN_USERNAME):
+            return "username";
+        case (COLUMN_EMAIL):
+            return "email";
+    }
+    return "";
+}
+
+const char* row_view_column(RowView* view, Column column, uint32_t* length) {
+    if (column == COLUMN_USERNAME) {
+        *length = view->username_length;
+        return view->username;
+    }
+    *length = view->email_length;
+    return view->email;
+}
+
+uint32_t serialized_row_size(void* source) {
+    uint8_t username_length = *(uint8_t*)source;
+    return 2 * sizeof(uint8_t) + username_length + *(uint8_t*)(source + 1 + username_length);
+}
+
+// The fixed layout of legacy leaves
+void deserialize_legacy_row(void* source, Row* destination) {
+    memcpy(&(destination->id),       source + ID_OFFSET,          ID_SIZE);
+    memcpy(&(destination->username), source + USERNAME_OFFSET,    USERNAME_SIZE);
+    memcpy(&(destination->email),    source + EMAIL_OFFSET,       EMAIL_SIZE);
+    destination->username[COLUMN_USERNAME_SIZE] = '\0';
+    destination->email[COLUMN_EMAIL_SIZE] = '\0';
+}
+
+// Scratch copies of pages come from the statement arena
+void* arena_alloc(uint32_t size);
+void arena_free(void* pointer, uint32_t size);
 
 /**
  * Accessing Leaf Node Fields  
@@ -185,29 +662,254 @@ void set_node_type(void* node, NodeType type) {
     *((uint8_t*)(node+ NODE_TYPE_OFFSET)) = value;
 }
 
+bool is_node_root(void* node) {
+    uint8_t value = *((uint8_t*)(node + IS_ROOT_OFFSET));
+    return (bool)value;
+}
+
+void set_node_root(void* node, bool is_root) {
+    uint8_t value = is_root;
+    *((uint8_t*)(node + IS_ROOT_OFFSET)) = value;
+}
+
+uint8_t* node_format(void* node) {
+    return (uint8_t*)(node + NODE_FORMAT_OFFSET);
+}
+
 uint32_t* leaf_node_num_cells(void* node) {
     return (uint32_t* )(node + LEAF_NODE_NUM_CELLS_OFFSET);
 }
 
-void* leaf_node_cell(void* node, uint32_t cell_num) {
-    return node + LEAF_NODE_HEADER_SIZE + cell_num * LEAF_NODE_CELL_SIZE;
+uint32_t* leaf_node_next_leaf(void* node) {
+    return (uint32_t* )(node + LEAF_NODE_NEXT_LEAF_OFFSET);
+}
+
+uint16_t* leaf_node_content_start(void* node) {
+    return (uint16_t*)(node + LEAF_NODE_CONTENT_START_OFFSET);
+}
+
+uint16_t* leaf_node_fragmented_bytes(void* node) {
+    return (uint16_t*)(node + LEAF_NODE_FRAGMENTED_OFFSET);
+}
+
+uint32_t* leaf_node_keys(void* node) {
+    return (uint32_t*)(node + LEAF_NODE_HEADER_SIZE);
 }
 
 uint32_t* leaf_node_key(void* node, uint32_t cell_num) {
-    return (uint32_t*)leaf_node_cell(node, cell_num);
+    return leaf_node_keys(node) + cell_num;
+}
+
+uint16_t* leaf_node_slot(void* node, uint32_t cell_num) {
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    return (uint16_t*)(node + LEAF_NODE_HEADER_SIZE + num_cells * LEAF_NODE_KEY_SIZE +
+                       cell_num * LEAF_NODE_SLOT_SIZE);
 }
 
 void* leaf_node_value(void* node, uint32_t cell_num) {
-    return leaf_node_cell(node, cell_num) + LEAF_NODE_KEY_SIZE;
+    return node + *leaf_node_slot(node, cell_num);
+}
+
+// Bytes of a cell apart from its slot: the key and the value
+uint32_t leaf_node_cell_size(void* node, uint32_t cell_num) {
+    return LEAF_NODE_KEY_SIZE + serialized_row_size(leaf_node_value(node, cell_num));
+}
+
+uint32_t leaf_node_slots_end(uint32_t num_cells) {
+    return LEAF_NODE_HEADER_SIZE + num_cells * (LEAF_NODE_KEY_SIZE + LEAF_NODE_SLOT_SIZE);
+}
+
+/**
+ * Bytes left for new cells and their slots, counting what compaction would win back.
+ **/
+uint32_t leaf_node_free_space(void* node) {
+    uint32_t slots_end = leaf_node_slots_end(*leaf_node_num_cells(node));
+    return *leaf_node_content_start(node) - slots_end + *leaf_node_fragmented_bytes(node);
+}
+
+bool leaf_node_has_room(void* node, uint32_t cell_size) {
+    return leaf_node_free_space(node) >= cell_size + LEAF_NODE_SLOT_SIZE;
 }
 
 void initialize_leaf_node(void* node) {
     set_node_type(node, NODE_LEAF);
     set_node_root(node, false);
+    *node_format(node) = LEAF_FORMAT_KEY_ARRAY;
     *leaf_node_num_cells(node) = 0;
+    *leaf_node_next_leaf(node) = 0;  // page 0 is the meta page, so it never is a sibling
+    *leaf_node_content_start(node) = PAGE_USABLE_SIZE;
+    *leaf_node_fragmented_bytes(node) = 0;
+}
+
+/**
+ * Number of keys below `key` among the `length` sorted keys at `keys`. The SIMD
+ * versions load whole vectors and mask off the lanes past the end; those stay
+ * inside the page because the slot array follows the keys.
+ **/
+uint32_t count_keys_below(uint32_t* keys, uint32_t length, uint32_t key) {
+    uint32_t count = 0;
+#if defined(__AVX2__)
+    // There are no unsigned compares, so both sides are biased into signed range
+    __m256i bias = _mm256_set1_epi32(INT32_MIN);
+    __m256i target = _mm256_xor_si256(_mm256_set1_epi32(key), bias);
+    for (uint32_t i = 0; i < length; i += 8) {
+        __m256i block = _mm256_xor_si256(_mm256_loadu_si256((__m256i*)(keys + i)), bias);
+        uint32_t mask = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(target, block)));
+        if (length - i < 8) {
+            mask &= (1u << (length - i)) - 1;
+        }
+        count += __builtin_popcount(mask);
+    }
+#elif defined(__SSE2__)
+    __m128i bias = _mm_set1_epi32(INT32_MIN);
+    __m128i target = _mm_xor_si128(_mm_set1_epi32(key), bias);
+    for (uint32_t i = 0; i < length; i += 4) {
+        __m128i block = _mm_xor_si128(_mm_loadu_si128((__m128i*)(keys + i)), bias);
+        uint32_t mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(target, block)));
+        if (length - i < 4) {
+            mask &= (1u << (length - i)) - 1;
+        }
+        count += __builtin_popcount(mask);
+    }
+#else
+    for (uint32_t i = 0; i < length; i++) {
+        count += keys[i] < key;
+    }
+#endif
+    return count;
+}
+
+/**
+ * Index of the first key not below `key`, num_cells if there is none.
+ * The halving steps compile to conditional moves, so there is no branch to
+ * mispredict, and the last LEAF_SEARCH_WINDOW keys are counted in one go.
+ **/
+uint32_t leaf_node_lower_bound(void* node, uint32_t key) {
+    uint32_t* keys = leaf_node_keys(node);
+    uint32_t base = 0;
+    uint32_t length = *leaf_node_num_cells(node);
+    while (length > LEAF_SEARCH_WINDOW) {
+        uint32_t half = length / 2;
+        bool below = keys[base + half] < key;
+        base = below ? base + half + 1 : base;
+        length = below ? length - half - 1 : half;
+    }
+    return base + count_keys_below(keys + base, length, key);
+}
+
+/**
+ * Pack the values against the end of the page again, in key order.
+ **/
+void leaf_node_compact(void* node) {
+    char* copy = (char*) arena_alloc(PAGE_SIZE);
+    memcpy(copy, node, PAGE_SIZE);
+
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    uint32_t offset = PAGE_USABLE_SIZE;
+    for (uint32_t i = 0; i < num_cells; i++) {
+        uint32_t value_size = leaf_node_cell_size(copy, i) - LEAF_NODE_KEY_SIZE;
+        offset -= value_size;
+        memcpy(node + offset, leaf_node_value(copy, i), value_size);
+        *leaf_node_slot(node, i) = offset;
+    }
+    *leaf_node_content_start(node) = offset;
+    *leaf_node_fragmented_bytes(node) = 0;
+    arena_free(copy, PAGE_SIZE);
+}
+
+/**
+ * Open a cell at cell_num, shifting the keys and slots after it, and write its key.
+ * The caller checked leaf_node_has_room and writes the value into the returned space.
+ **/
+void* leaf_node_insert_cell(void* node, uint32_t cell_num, uint32_t key, uint32_t value_size) {
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    if (*leaf_node_content_start(node) < leaf_node_slots_end(num_cells + 1) + value_size) {
+        leaf_node_compact(node);
+    }
+
+    // The slot array starts one key further on: slots after cell_num move
+    // by a key and a slot, the ones before it by a key.
+    uint16_t* slots = leaf_node_slot(node, 0);
+    uint16_t* new_slots = (uint16_t*)((void*)slots + LEAF_NODE_KEY_SIZE);
+    memmove(new_slots + cell_num + 1, slots + cell_num, (num_cells - cell_num) * LEAF_NODE_SLOT_SIZE);
+    memmove(new_slots, slots, cell_num * LEAF_NODE_SLOT_SIZE);
+    uint32_t* keys = leaf_node_keys(node);
+    memmove(keys + cell_num + 1, keys + cell_num, (num_cells - cell_num) * LEAF_NODE_KEY_SIZE);
+
+    uint16_t offset = *leaf_node_content_start(node) - value_size;
+    *leaf_node_content_start(node) = offset;
+    *leaf_node_num_cells(node) = num_cells + 1;
+    *leaf_node_slot(node, cell_num) = offset;
+    keys[cell_num] = key;
+    return node + offset;
+}
+
+/**
+ * Close the gap of cell_num in the keys and slots. Its value stays behind as
+ * fragmented bytes until the next compaction.
+ **/
+void leaf_node_delete_cell(void* node, uint32_t cell_num) {
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    uint32_t value_size = leaf_node_cell_size(node, cell_num) - LEAF_NODE_KEY_SIZE;
+
+    // The slot array starts one key earlier: slots before cell_num move by a key,
+    // the ones after it by a key and a slot.
+    uint32_t* keys = leaf_node_keys(node);
+    uint16_t* slots = leaf_node_slot(node, 0);
+    uint16_t* new_slots = (uint16_t*)((void*)slots - LEAF_NODE_KEY_SIZE);
+    memmove(keys + cell_num, keys + cell_num + 1, (num_cells - cell_num - 1) * LEAF_NODE_KEY_SIZE);
+    memmove(new_slots, slots, cell_num * LEAF_NODE_SLOT_SIZE);
+    memmove(new_slots + cell_num, slots + cell_num + 1, (num_cells - cell_num - 1) * LEAF_NODE_SLOT_SIZE);
+
+    *leaf_node_num_cells(node) = num_cells - 1;
+    *leaf_node_fragmented_bytes(node) += value_size;
+}
+
+uint32_t leaf_node_used_space(void* node) {
+    return LEAF_NODE_SPACE_FOR_CELLS - leaf_node_free_space(node);
 }
 
-void initialize
+bool leaf_node_is_legacy(void* node) {
+    return get_node_type(node) == NODE_LEAF && *node_format(node) != LEAF_FORMAT_KEY_ARRAY &&
+           *node_format(node) != LEAF_FORMAT_INDEX;
+}
+
+/**
+ * Rewrite a leaf of an older format in place in the current one.
+ **/
+void leaf_node_upgrade(void* node) {
+    char* copy = (char*) arena_alloc(PAGE_SIZE);
+    memcpy(copy, node, PAGE_SIZE);
+
+    uint8_t format = *node_format(copy);
+    uint32_t num_cells = *leaf_node_num_cells(copy);
+    if ((format == LEAF_FORMAT_FIXED && num_cells > LEGACY_LEAF_NODE_MAX_CELLS) ||
+        (format == LEAF_FORMAT_SLOTTED && leaf_node_slots_end(num_cells) > PAGE_SIZE) ||
+        format > LEAF_FORMAT_KEY_ARRAY) {
+        printf("Leaf of format %d holds %d cells. Corrupt file.\n", format, num_cells);
+        exit(EXIT_FAILURE);
+    }
+    *node_format(node) = LEAF_FORMAT_KEY_ARRAY;
+    *leaf_node_num_cells(node) = 0;
+    *leaf_node_content_start(node) = PAGE_USABLE_SIZE;
+    *leaf_node_fragmented_bytes(node) = 0;
+    for (uint32_t i = 0; i < num_cells; i++) {
+        uint32_t key;
+        Row row;
+        if (format == LEAF_FORMAT_FIXED) {
+            void* cell = copy + LEGACY_LEAF_NODE_HEADER_SIZE + i * LEGACY_LEAF_NODE_CELL_SIZE;
+            key = *(uint32_t*)cell;
+            deserialize_legacy_row(cell + LEAF_NODE_KEY_SIZE, &row);
+        } else {
+            // Slots right after the header, each cell starting with its key
+            uint16_t offset = *(uint16_t*)(copy + LEAF_NODE_HEADER_SIZE + i * LEAF_NODE_SLOT_SIZE);
+            key = *(uint32_t*)(copy + offset);
+            deserialize_row(key, copy + offset + LEAF_NODE_KEY_SIZE, &row);
+        }
+        serialize_row(&row, leaf_node_insert_cell(node, i, key, row_value_size(&row)));
+    }
+    arena_free(copy, PAGE_SIZE);
+}
 
 /**
  * Accessing internal node methods 
@@ -216,12 +918,30 @@ uint32_t* internal_node_num_keys(void* node) {
     return (uint32_t* )(node + INTERNAL_NODE_NUM_KEYS_OFFSET);
 }
 
+uint8_t* internal_node_key_width(void* node) {
+    return (uint8_t*)(node + INTERNAL_NODE_KEY_WIDTH_OFFSET);
+}
+
+uint64_t* internal_node_key_base(void* node) {
+    return (uint64_t*)(node + INTERNAL_NODE_KEY_BASE_OFFSET);
+}
+
+void initialize_internal_node(void* node) {
+    set_node_type(node, NODE_INTERNAL);
+    set_node_root(node, false);
+    *node_format(node) = INTERNAL_FORMAT_DELTA;
+    *internal_node_key_width(node) = 1;
+    *internal_node_num_keys(node) = 0;
+    *internal_node_key_base(node) = 0;
+}
+
 uint32_t* internal_node_right_child(void* node) {
     return (uint32_t* )(node + INTERNAL_NODE_RIGHT_CHILD_OFFSET);
 }
 
+// Children other than the right one, counted from the end of the usable page
 uint32_t* internal_node_cell(void* node, uint32_t cell_num) {
-    return (uint32_t* )(node + INTERNAL_NODE_HEADER_SIZE + cell_num * INTERNAL_NODE_CELL_SIZE);
+    return (uint32_t* )(node + PAGE_USABLE_SIZE - (cell_num + 1) * INTERNAL_NODE_CHILD_SIZE);
 }
 
 uint32_t* internal_node_child(void* node, uint32_t child_num) {
@@ -236,565 +956,5834 @@ uint32_t* internal_node_child(void* node, uint32_t child_num) {
     }
 }
 
-uint32_t* internal_node_key(void* node, uint32_t key_num) {
-    return internal_node_cell(node, key_num) + INTERNAL_NODE_CHILD_SIZE;
+void* internal_node_delta(void* node, uint32_t key_num) {
+    return node + INTERNAL_NODE_HEADER_SIZE + key_num * *internal_node_key_width(node);
 }
 
-
-/* For an internal node, the maximum key is always its right key. For a leaf node, 
-   it’s the key at the maximum index
-*/
-
-uint32_t get_node_max_key(void* node) {
-    switch (get_node_type(node)) {
-        case NODE_INTERNAL:
-            return *internal_node_key(node, *internal_node_num_keys(node) - 1);
-        case NODE_LEAF:
-            return *leaf_node_key(node, *leaf_node_num_cells(node) - 1);
+uint64_t internal_node_key(void* node, uint32_t key_num) {
+    void* delta = internal_node_delta(node, key_num);
+    uint64_t base = *internal_node_key_base(node);
+    switch (*internal_node_key_width(node)) {
+        case 1: return base + *(uint8_t*)delta;
+        case 2: return base + *(uint16_t*)delta;
+        case 4: return base + *(uint32_t*)delta;
+        default: return base + *(uint64_t*)delta;
     }
 }
-// Row methods
-void serialize_row(Row* source, void* destination) {
-    memcpy(destination + ID_OFFSET,       &(source->id),          ID_SIZE);
-    memcpy(destination + USERNAME_OFFSET, &(source->username),    USERNAME_SIZE);
-    memcpy(destination + EMAIL_OFFSET,    &(source->email),       EMAIL_SIZE);
-}
 
-void deserialize_row(void* source, Row* destination) {
-    memcpy(&(destination->id),       source + ID_OFFSET,          ID_SIZE);
-    memcpy(&(destination->username), source + USERNAME_OFFSET,    USERNAME_SIZE);
-    memcpy(&(destination->email),    source + EMAIL_OFFSET,       EMAIL_SIZE);
+void internal_node_set_key(void* node, uint32_t key_num, uint64_t key) {
+    void* delta = internal_node_delta(node, key_num);
+    uint64_t value = key - *internal_node_key_base(node);
+    switch (*internal_node_key_width(node)) {
+        case 1: *(uint8_t*)delta = value; break;
+        case 2: *(uint16_t*)delta = value; break;
+        case 4: *(uint32_t*)delta = value; break;
+        default: *(uint64_t*)delta = value; break;
+    }
 }
 
-void print_row(Row* row) {
-    printf("(%d, %s, %s)\n", row->id, row->username, row->email);
+uint8_t internal_node_width_for(uint64_t range) {
+    if (range <= UINT8_MAX) return 1;
+    if (range <= UINT16_MAX) return 2;
+    if (range <= UINT32_MAX) return 4;
+    return 8;
 }
 
+uint32_t internal_node_capacity(uint8_t width) {
+    return INTERNAL_NODE_SPACE_FOR_CELLS / (width + INTERNAL_NODE_CHILD_SIZE);
+}
 
 /**
- * page methods
+ * Keys the node could hold once key is among them, which depends on how far
+ * key is from the ones already there.
  **/
-//TODO FIX IT LATER
-uint32_t get_unused_page_num(Pager* pager) {
-    return pager->num_pages;
+uint32_t internal_node_max_keys(void* node, uint64_t key) {
+    uint32_t num_keys = *internal_node_num_keys(node);
+    if (num_keys == 0) {
+        return internal_node_capacity(1);
+    }
+    uint64_t lowest = internal_node_key(node, 0);
+    uint64_t highest = internal_node_key(node, num_keys - 1);
+    if (key < lowest) lowest = key;
+    if (key > highest) highest = key;
+    return internal_node_capacity(internal_node_width_for(highest - lowest));
 }
 
-void* get_page(Pager* pager, uint32_t page_num) {
-    if (page_num > TABLE_MAX_PAGES) {
-        printf("Tried to fetch page number out of bound.  %d > %d\n", page_num, TABLE_MAX_PAGES);
+bool internal_node_has_room(void* node, uint64_t key) {
+    return *internal_node_num_keys(node) + 1 <= internal_node_max_keys(node, key);
+}
+
+/**
+ * Fill the node with num_keys sorted keys and num_keys + 1 children, the
+ * last one being the right child, choosing the narrowest encoding.
+ **/
+void internal_node_set_cells(void* node, uint64_t* keys, uint32_t* children, uint32_t num_keys) {
+    uint64_t base = num_keys > 0 ? keys[0] : 0;
+    uint8_t width = internal_node_width_for(num_keys > 0 ? keys[num_keys - 1] - base : 0);
+    if (num_keys > internal_node_capacity(width)) {
+        printf("Tried to put %d keys of %d bytes into an internal node\n", num_keys, width);
         exit(EXIT_FAILURE);
     }
-
-    if (pager->pages[page_num] == NULL) { // CACHE
-        // Cache miss. Allocaate memory and load from file.
-        void* page = malloc(PAGE_SIZE);
-        uint32_t num_pages = pager->file_length / PAGE_SIZE;
-
-        if (pager->file_length % PAGE_SIZE) {
-            num_pages += 1;
-        }
-        if (page_num <= num_pages) {
-            lseek(pager->file_descriptor, page_num * PAGE_SIZE, SEEK_SET);  // SEEK_SET --- Start of the file
-            ssize_t bytes_read = read(pager->file_descriptor, page, PAGE_SIZE);
-            if (bytes_read == -1) {
-                printf("Error reading file: %d\n", errno);
-                exit(EXIT_FAILURE);
-            }
-        }
-        pager->pages[page_num] = page;
-
-        if (page_num >= pager->num_pages) {
-            pager->num_pages = page_num + 1;
-        }
+    *node_format(node) = INTERNAL_FORMAT_DELTA;
+    *internal_node_key_width(node) = width;
+    *internal_node_key_base(node) = base;
+    *internal_node_num_keys(node) = num_keys;
+    for (uint32_t i = 0; i < num_keys; i++) {
+        internal_node_set_key(node, i, keys[i]);
+        *internal_node_cell(node, i) = children[i];
     }
-    return pager->pages[page_num];
+    *internal_node_right_child(node) = children[num_keys];
 }
 
-Pager* pager_open(const char* filename) {
-    int fd = open(filename, 
-                  O_RDWR | // Read and Write mode
-                  O_CREAT, // Create file if it doesn't exist
-                  S_IWUSR| // User write permission
-                  S_IRUSR  // User read permission
-                 );
-    if (fd == -1) {
-        printf("Unable to open file(db)\n");
-        exit(EXIT_FAILURE);
+// The reverse of internal_node_set_cells; children gets num_keys + 1 entries
+void internal_node_get_cells(void* node, uint64_t* keys, uint32_t* children) {
+    uint32_t num_keys = *internal_node_num_keys(node);
+    for (uint32_t i = 0; i < num_keys; i++) {
+        keys[i] = internal_node_key(node, i);
+        children[i] = *internal_node_cell(node, i);
     }
+    children[num_keys] = *internal_node_right_child(node);
+}
 
-    off_t file_length = lseek(fd, 0, SEEK_END); // WHAT IS OFF_T?
-    Pager* pager = (Pager*) malloc(sizeof(Pager));
-
-    pager->file_descriptor = fd;
-    pager->file_length = file_length;
-
-    pager->num_pages = (file_length / PAGE_SIZE);
-
-    if (file_length % PAGE_SIZE != 0) {
-        printf("Db file is not a whole number of pages. Corrupt file.\n");
-        exit(EXIT_FAILURE);
+/**
+ * Put key at key_num and new_child right after the child at key_num, which
+ * now ends at key. The caller checked internal_node_has_room. When key does
+ * not fit the node's base and width the node is encoded again.
+ **/
+void internal_node_insert_cell(void* node, uint32_t key_num, uint64_t key, uint32_t new_child) {
+    uint32_t num_keys = *internal_node_num_keys(node);
+    uint8_t width = *internal_node_key_width(node);
+    uint64_t base = *internal_node_key_base(node);
+    bool fits = num_keys > 0 && key >= base && internal_node_width_for(key - base) <= width &&
+                num_keys + 1 <= internal_node_capacity(width);
+
+    if (!fits) {
+        uint64_t* keys = (uint64_t*) arena_alloc(sizeof(uint64_t) * (num_keys + 1));
+        uint32_t* children = (uint32_t*) arena_alloc(sizeof(uint32_t) * (num_keys + 2));
+        for (uint32_t i = 0, k = 0, c = 0; i <= num_keys; i++) {
+            if (i == key_num) {
+                keys[k++] = key;
+            }
+            if (i < num_keys) {
+                keys[k++] = internal_node_key(node, i);
+            }
+            children[c++] = *internal_node_child(node, i);
+            if (i == key_num) {
+                children[c++] = new_child;
+            }
+        }
+        internal_node_set_cells(node, keys, children, num_keys + 1);
+        arena_free(children, sizeof(uint32_t) * (num_keys + 2));
+        arena_free(keys, sizeof(uint64_t) * (num_keys + 1));
+        return;
     }
 
-    for(uint32_t i = 0; i < TABLE_MAX_PAGES; i++) {
-        pager->pages[i] = NULL;
+    memmove(internal_node_delta(node, key_num + 1), internal_node_delta(node, key_num),
+            (num_keys - key_num) * width);
+    if (key_num == num_keys) {
+        *internal_node_cell(node, num_keys) = *internal_node_right_child(node);
+        *internal_node_right_child(node) = new_child;
+    } else {
+        // Children key_num + 1 .. num_keys - 1 move one place on, which is down the page
+        memmove(internal_node_cell(node, num_keys), internal_node_cell(node, num_keys - 1),
+                (num_keys - 1 - key_num) * INTERNAL_NODE_CHILD_SIZE);
+        *internal_node_cell(node, key_num + 1) = new_child;
     }
-    return pager;
+    *internal_node_num_keys(node) = num_keys + 1;
+    internal_node_set_key(node, key_num, key);
 }
 
-void pager_flush(Pager* pager, uint32_t page_num) {
-    if (pager->pages[page_num] == NULL) {
-        printf("Tried to flush null page\n");
+bool internal_node_is_plain(void* node) {
+    // Plain nodes did not set the format byte, and a root that used to be a leaf
+    // kept the leaf's, so anything but the current format is plain. A fresh page
+    // reads as a plain node without keys, which is left alone.
+    return get_node_type(node) == NODE_INTERNAL && *node_format(node) != INTERNAL_FORMAT_DELTA &&
+           *internal_node_num_keys(node) > 0;
+}
+
+void internal_node_upgrade(void* node) {
+    uint32_t num_keys = *internal_node_num_keys(node);
+    if (num_keys > (PAGE_SIZE - PLAIN_INTERNAL_NODE_HEADER_SIZE) / PLAIN_INTERNAL_NODE_CELL_SIZE) {
+        printf("Internal node holds %d keys. Corrupt file.\n", num_keys);
         exit(EXIT_FAILURE);
     }
-    off_t offset = lseek(pager->file_descriptor, page_num * PAGE_SIZE, SEEK_SET);
-    
-    if (offset == -1) {
-        printf("Error seeking: %d\n", errno);
-        exit(EXIT_FAILURE);
+    uint64_t* keys = (uint64_t*) arena_alloc(sizeof(uint64_t) * num_keys);
+    uint32_t* children = (uint32_t*) arena_alloc(sizeof(uint32_t) * (num_keys + 1));
+    for (uint32_t i = 0; i < num_keys; i++) {
+        uint32_t* cell = (uint32_t*)(node + PLAIN_INTERNAL_NODE_HEADER_SIZE + i * PLAIN_INTERNAL_NODE_CELL_SIZE);
+        children[i] = cell[0];
+        keys[i] = cell[1];
     }
+    children[num_keys] = *internal_node_right_child(node);
+    internal_node_set_cells(node, keys, children, num_keys);
+    arena_free(children, sizeof(uint32_t) * (num_keys + 1));
+    arena_free(keys, sizeof(uint64_t) * num_keys);
+}
 
-    ssize_t bytes_written = write(pager->file_descriptor, pager->pages[page_num], PAGE_SIZE);
-    if (bytes_written == -1) {
-        printf("Error writing: %d\n", errno);
-        exit(EXIT_FAILURE);
+/**
+ * Pages written by older versions are converted to the current layouts as
+ * they are read in.
+ **/
+void node_upgrade_if_needed(void* node) {
+    if (leaf_node_is_legacy(node)) {
+        leaf_node_upgrade(node);
+    } else if (internal_node_is_plain(node)) {
+        internal_node_upgrade(node);
     }
 }
 
 /**
- *  cursor methods
+ * Accessing index leaf fields
  **/
-Cursor* table_start(Table* table) {
-    Cursor* cursor = (Cursor* ) malloc(sizeof(Cursor));
-    cursor->table = table;
-    cursor->page_num = table->root_page_num;
-    cursor->cell_num = 0;
-
-    void* root_node = get_page(table->pager, table->root_page_num);
-
-    uint32_t num_cells = *leaf_node_num_cells(root_node);
+uint64_t* index_leaf_entry(void* node, uint32_t entry_num) {
+    return (uint64_t*)(node + INDEX_LEAF_HEADER_SIZE + entry_num * INDEX_ENTRY_SIZE);
+}
 
-    cursor->end_of_table = (num_cells == 0);
+void initialize_index_leaf(void* node) {
+    set_node_type(node, NODE_LEAF);
+    set_node_root(node, false);
+    *node_format(node) = LEAF_FORMAT_INDEX;
+    *leaf_node_num_cells(node) = 0;
+    *leaf_node_next_leaf(node) = 0;
+}
+
+uint32_t index_leaf_lower_bound(void* node, uint64_t key) {
+    uint32_t min_index = 0;
+    uint32_t max_index = *leaf_node_num_cells(node);
+    while (min_index != max_index) {
+        uint32_t index = (min_index + max_index) / 2;
+        if (*index_leaf_entry(node, index) < key) {
+            min_index = index + 1;
+        } else {
+            max_index = index;
+        }
+    }
+    return min_index;
+}
+
+/**
+ * Accessing meta page fields
+ **/
+uint8_t* meta_marker(void* page) {
+    return (uint8_t*)(page + META_MARKER_OFFSET);
+}
+
+uint32_t* meta_table_root(void* page) {
+    return (uint32_t*)(page + META_TABLE_ROOT_OFFSET);
+}
+
+uint32_t* meta_num_indexes(void* page) {
+    return (uint32_t*)(page + META_NUM_INDEXES_OFFSET);
+}
+
+uint32_t* meta_index_column(void* page, uint32_t index_num) {
+    return (uint32_t*)(page + META_INDEXES_OFFSET + index_num * META_INDEX_SIZE);
+}
+
+uint32_t* meta_index_root(void* page, uint32_t index_num) {
+    return meta_index_column(page, index_num) + 1;
+}
+
+uint32_t* meta_freelist_head(void* page) {
+    return (uint32_t*)(page + META_FREELIST_OFFSET);
+}
+
+uint32_t* meta_free_pages(void* page) {
+    return (uint32_t*)(page + META_FREE_PAGES_OFFSET);
+}
+
+char* meta_magic(void* page) {
+    return (char*)(page + META_MAGIC_OFFSET);
+}
+
+uint32_t* meta_format_version(void* page) {
+    return (uint32_t*)(page + META_FORMAT_OFFSET);
+}
+
+uint32_t* meta_page_size(void* page) {
+    return (uint32_t*)(page + META_PAGE_SIZE_OFFSET);
+}
+
+uint32_t* free_page_next(void* page) {
+    return (uint32_t*)(page + FREE_PAGE_NEXT_OFFSET);
+}
+
+
+/* For an internal node, the maximum key is always its right key. For a leaf node, 
+   it’s the key at the maximum index
+*/
+
+uint64_t get_node_max_key(void* node) {
+    switch (get_node_type(node)) {
+        case NODE_INTERNAL:
+            return internal_node_key(node, *internal_node_num_keys(node) - 1);
+        case NODE_LEAF:
+            return *leaf_node_key(node, *leaf_node_num_cells(node) - 1);
+    }
+    printf("Node of type %d. Corrupt file.\n", get_node_type(node));
+    exit(EXIT_FAILURE);
+}
+/**
+ * Check the values of a row before copying them in, shared by insert and .import.
+ **/
+PrepareResult prepare_row(char* id_string, char* username, char* email, Row* row) {
+    if(id_string == NULL || username == NULL || email == NULL) {
+        return PREPARE_SYNTAX_ERROR;
+    }
+    int id = atoi(id_string);
+    if (id < 0) return PREPARE_NEGATIVE_ID;
+    if (strlen(username) > COLUMN_USERNAME_SIZE) {
+        return PREPARE_STRING_TOO_LONG;
+    }
+    if(strlen(email) > COLUMN_EMAIL_SIZE) {
+        return PREPARE_STRING_TOO_LONG;
+    }
+
+    row->id = id;
+    strcpy(row->username, username);
+    strcpy(row->email,    email);
+    return PREPARE_SUCCESS;
+}
+
+/**
+ * Result sink
+ * select formats its rows into one large buffer that goes out with a single
+ * write() each time it fills up, instead of a printf per row. Integers are
+ * formatted by hand.
+ **/
+typedef void (*SinkWriter)(void* target, const char* data, uint32_t length);
+
+struct ResultSink_t {
+    int fd;             // RESULT_SINK_HELD to keep the output in memory, RESULT_SINK_WRITER to pass it on
+    OutputFormat format;
+    SinkWriter writer;
+    void* writer_target;
+    uint32_t length;
+    struct ResultSink_t* full;          // buffers a held sink filled, oldest first
+    struct ResultSink_t* last_full;
+    struct ResultSink_t* next;
+    char buffer[RESULT_SINK_BUFFER_SIZE];
+};
+typedef struct ResultSink_t ResultSink;
+
+// The longest row in any format: CSV may double every string character
+const uint32_t RESULT_SINK_MAX_ROW_SIZE = 16 + 2 * (COLUMN_USERNAME_SIZE + COLUMN_EMAIL_SIZE) + 8;
+
+ResultSink* sink_open(int fd, OutputFormat format) {
+    if (fd >= 0) {
+        // The prompt and messages go through stdio, which has to be written out first
+        fflush(stdout);
+    }
+    ResultSink* sink = (ResultSink*) malloc(sizeof(ResultSink));
+    sink->fd = fd;
+    sink->format = format;
+    sink->length = 0;
+    sink->full = NULL;
+    sink->last_full = NULL;
+    sink->next = NULL;
+    sink->writer = NULL;
+    sink->writer_target = NULL;
+    return sink;
+}
+
+// A sink whose output goes to writer each time the buffer fills up
+ResultSink* sink_open_writer(SinkWriter writer, void* target, OutputFormat format) {
+    ResultSink* sink = sink_open(RESULT_SINK_WRITER, format);
+    sink->writer = writer;
+    sink->writer_target = target;
+    return sink;
+}
+
+void sink_flush(ResultSink* sink) {
+    if (sink->fd == RESULT_SINK_HELD) {
+        ResultSink* full = (ResultSink*) malloc(sizeof(ResultSink));
+        memcpy(full, sink, sizeof(ResultSink));
+        full->next = NULL;
+        if (sink->last_full == NULL) {
+            sink->full = full;
+        } else {
+            sink->last_full->next = full;
+        }
+        sink->last_full = full;
+        sink->length = 0;
+        return;
+    }
+    if (sink->fd == RESULT_SINK_WRITER) {
+        sink->writer(sink->writer_target, sink->buffer, sink->length);
+        sink->length = 0;
+        return;
+    }
+    uint32_t written = 0;
+    while (written < sink->length) {
+        ssize_t bytes = write(sink->fd, sink->buffer + written, sink->length - written);
+        if (bytes == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            printf("Error writing results: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+        written += bytes;
+    }
+    sink->length = 0;
+}
+
+void sink_close(ResultSink* sink) {
+    sink_flush(sink);
+    free(sink);
+}
+
+void sink_append(ResultSink* sink, const char* data, uint32_t length) {
+    if (sink->length + length > RESULT_SINK_BUFFER_SIZE) {
+        sink_flush(sink);
+    }
+    memcpy(sink->buffer + sink->length, data, length);
+    sink->length += length;
+}
+
+// Pass on a list of buffers a held sink filled, and free them. Returns how many there were.
+uint32_t sink_write_buffers(ResultSink* sink, ResultSink* full) {
+    uint32_t num_buffers = 0;
+    while (full != NULL) {
+        ResultSink* next = full->next;
+        sink_append(sink, full->buffer, full->length);
+        free(full);
+        full = next;
+        num_buffers++;
+    }
+    return num_buffers;
+}
+
+char* format_uint32(char* dest, uint32_t value) {
+    char digits[10];
+    uint32_t count = 0;
+    do {
+        digits[count++] = '0' + value % 10;
+        value /= 10;
+    } while (value != 0);
+    while (count > 0) {
+        *dest++ = digits[--count];
+    }
+    return dest;
+}
+
+char* format_string(char* dest, const char* string, uint32_t length) {
+    memcpy(dest, string, length);
+    return dest + length;
+}
+
+// Quoted only when needed, with quotes inside doubled
+char* format_csv_field(char* dest, const char* string, uint32_t length) {
+    bool quote = false;
+    for (uint32_t i = 0; i < length && !quote; i++) {
+        quote = string[i] == ',' || string[i] == '"' || string[i] == '\n';
+    }
+    if (!quote) {
+        return format_string(dest, string, length);
+    }
+    *dest++ = '"';
+    for (uint32_t i = 0; i < length; i++) {
+        if (string[i] == '"') {
+            *dest++ = '"';
+        }
+        *dest++ = string[i];
+    }
+    *dest++ = '"';
+    return dest;
+}
+
+// The columns of the row given by the columns bits, in table order
+void sink_row(ResultSink* sink, RowView* row, uint32_t columns) {
+    if (sink->length + RESULT_SINK_MAX_ROW_SIZE > RESULT_SINK_BUFFER_SIZE) {
+        sink_flush(sink);
+    }
+    char* start = sink->buffer + sink->length;
+    char* dest = start;
+    if (sink->format == OUTPUT_TEXT) {
+        *dest++ = '(';
+    }
+    bool first = true;
+    for (Column column = COLUMN_ID; column <= COLUMN_EMAIL; column = (Column)(column + 1)) {
+        if ((columns & COLUMN_BIT(column)) == 0) {
+            continue;
+        }
+        if (!first && sink->format != OUTPUT_BINARY) {
+            *dest++ = ',';
+            if (sink->format == OUTPUT_TEXT) {
+                *dest++ = ' ';
+            }
+        }
+        first = false;
+
+        if (column == COLUMN_ID) {
+            if (sink->format == OUTPUT_BINARY) {
+                memcpy(dest, &(row->id), sizeof(uint32_t));
+                dest += sizeof(uint32_t);
+            } else {
+                dest = format_uint32(dest, row->id);
+            }
+            continue;
+        }
+        uint32_t length;
+        const char* string = row_view_column(row, column, &length);
+        switch (sink->format) {
+            case (OUTPUT_TEXT):
+                dest = format_string(dest, string, length);
+                break;
+            case (OUTPUT_CSV):
+                dest = format_csv_field(dest, string, length);
+                break;
+            case (OUTPUT_BINARY):
+                *(uint8_t*)dest++ = length;
+                dest = format_string(dest, string, length);
+                break;
+        }
+    }
+    if (sink->format == OUTPUT_TEXT) {
+        *dest++ = ')';
+    }
+    if (sink->format != OUTPUT_BINARY) {
+        *dest++ = '\n';
+    }
+    sink->length += dest - start;
+}
+
+
+/**
+ * page methods
+ **/
+uint32_t get_unused_page_num(Pager* pager);
+void free_page(Pager* pager, uint32_t page_num);
+
+void stats_add(uint64_t* counter, uint64_t amount) {
+    __atomic_fetch_add(counter, amount, __ATOMIC_RELAXED);
+}
+
+uint64_t stats_get(uint64_t* counter) {
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+/**
+ * buffer pool methods
+ **/
+uint32_t page_table_slot(Pager* pager, uint32_t page_num) {
+    // Fibonacci hashing spreads consecutive page numbers over the table
+    return (page_num * 2654435769u) & pager->page_table_mask;
+}
+
+uint32_t page_table_find(Pager* pager, uint32_t page_num) {
+    uint32_t slot = page_table_slot(pager, page_num);
+    while (pager->page_table[slot] != INVALID_FRAME) {
+        uint32_t frame_num = pager->page_table[slot];
+        if (pager->frames[frame_num].page_num == page_num) {
+            return frame_num;
+        }
+        slot = (slot + 1) & pager->page_table_mask;
+    }
+    return INVALID_FRAME;
+}
+
+void page_table_insert(Pager* pager, uint32_t page_num, uint32_t frame_num) {
+    uint32_t slot = page_table_slot(pager, page_num);
+    while (pager->page_table[slot] != INVALID_FRAME) {
+        slot = (slot + 1) & pager->page_table_mask;
+    }
+    pager->page_table[slot] = frame_num;
+}
+
+void page_table_remove(Pager* pager, uint32_t page_num) {
+    uint32_t mask = pager->page_table_mask;
+    uint32_t slot = page_table_slot(pager, page_num);
+    while (pager->frames[pager->page_table[slot]].page_num != page_num) {
+        slot = (slot + 1) & mask;
+    }
+    pager->page_table[slot] = INVALID_FRAME;
+
+    // Backward-shift deletion: pull later entries of the probe run into the hole
+    // so that lookups never stop early at an empty slot.
+    uint32_t hole = slot;
+    slot = (slot + 1) & mask;
+    while (pager->page_table[slot] != INVALID_FRAME) {
+        uint32_t frame_num = pager->page_table[slot];
+        uint32_t home = page_table_slot(pager, pager->frames[frame_num].page_num);
+        if (((slot - home) & mask) >= ((slot - hole) & mask)) {
+            pager->page_table[hole] = frame_num;
+            pager->page_table[slot] = INVALID_FRAME;
+            hole = slot;
+        }
+        slot = (slot + 1) & mask;
+    }
+}
+
+/**
+ * Page checksums
+ * In files of FILE_FORMAT_CHECKSUMS the last PAGE_CHECKSUM_SIZE bytes of a page
+ * hold the CRC32C of the bytes before them. A page is sealed whenever its image
+ * leaves the process, for the log or for the db file, and checked when it is
+ * read back in, so a torn write or a flipped bit stops the process instead of
+ * being taken for a node. A page that was never written reads as zeros and
+ * passes. Nothing but the sealing touches the checksum: readers copy and
+ * search only the usable bytes, so the writer may seal a page they look at.
+ *
+ * x86-64 processors with SSE4.2 compute CRC32C 8 bytes an instruction; others
+ * go through a table a byte at a time.
+ **/
+#define CRC32C_POLY             0x82F63B78  // Castagnoli, bit-reversed
+uint32_t crc32c_table[256];
+bool crc32c_hardware = false;
+pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+void crc32c_init() {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (uint32_t bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ (CRC32C_POLY & (0 - (crc & 1)));
+        }
+        crc32c_table[i] = crc;
+    }
+#if defined(__x86_64__)
+    crc32c_hardware = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+uint32_t crc32c_sse42(const void* data, uint32_t length) {
+    const uint8_t* bytes = (const uint8_t*)data;
+    uint64_t crc = UINT32_MAX;
+    for (; length >= sizeof(uint64_t); length -= sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, bytes, sizeof(word));
+        crc = _mm_crc32_u64(crc, word);
+        bytes += sizeof(uint64_t);
+    }
+    uint32_t crc32 = (uint32_t)crc;
+    for (; length > 0; length--) {
+        crc32 = _mm_crc32_u8(crc32, *bytes++);
+    }
+    return ~crc32;
+}
+#endif
+
+uint32_t crc32c(const void* data, uint32_t length) {
+#if defined(__x86_64__)
+    if (crc32c_hardware) {
+        return crc32c_sse42(data, length);
+    }
+#endif
+    const uint8_t* bytes = (const uint8_t*)data;
+    uint32_t crc = UINT32_MAX;
+    for (uint32_t i = 0; i < length; i++) {
+        crc = (crc >> 8) ^ crc32c_table[(crc ^ bytes[i]) & 0xFF];
+    }
+    return ~crc;
+}
+
+uint32_t* page_checksum(void* page) {
+    return (uint32_t*)(page + PAGE_USABLE_SIZE);
+}
+
+void page_seal(Pager* pager, void* page) {
+    if (pager->checksums) {
+        *page_checksum(page) = crc32c(page, PAGE_USABLE_SIZE);
+    }
+}
+
+bool page_is_zero(void* page) {
+    uint64_t* words = (uint64_t*)page;
+    for (uint32_t i = 0; i < PAGE_SIZE / sizeof(uint64_t); i++) {
+        if (words[i] != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void page_verify(Pager* pager, uint32_t page_num, void* page) {
+    if (!pager->checksums || crc32c(page, PAGE_USABLE_SIZE) == *page_checksum(page)) {
+        return;
+    }
+    if (!page_is_zero(page)) {
+        printf("Page %d is corrupt: checksum mismatch.\n", page_num);
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * Set the page size and usable page size of the file being opened, and what
+ * follows from them. All open files share the layout.
+ **/
+uint32_t num_open_pagers = 0;
+
+void page_layout_init(uint32_t page_size, uint32_t usable_size) {
+    if (num_open_pagers > 0 && (page_size != PAGE_SIZE || usable_size != PAGE_USABLE_SIZE)) {
+        printf("Db files of different formats cannot be open at once.\n");
+        exit(EXIT_FAILURE);
+    }
+    PAGE_SIZE = page_size;
+    PAGE_USABLE_SIZE = usable_size;
+    LEAF_NODE_SPACE_FOR_CELLS = usable_size - LEAF_NODE_HEADER_SIZE;
+    INTERNAL_NODE_SPACE_FOR_CELLS = usable_size - INTERNAL_NODE_HEADER_SIZE;
+    INDEX_LEAF_MAX_ENTRIES = (usable_size - INDEX_LEAF_HEADER_SIZE) / INDEX_ENTRY_SIZE;
+}
+
+/**
+ * WAL methods
+ **/
+uint64_t now_usec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+uint32_t wal_checksum(uint32_t seed, const void* data, uint32_t length) {
+    const uint32_t* words = (const uint32_t*)data;
+    uint32_t s0 = seed;
+    uint32_t s1 = 0;
+    for (uint32_t i = 0; i < length / sizeof(uint32_t); i++) {
+        s0 += words[i] + s1;
+        s1 += s0;
+    }
+    return s0 ^ s1;
+}
+
+uint32_t wal_record_page_size(WalRecordHeader* header) {
+    return header->page_size == 0 ? LEGACY_PAGE_SIZE : header->page_size;
+}
+
+uint32_t wal_record_checksum(uint32_t seed, WalRecordHeader* header, void* page) {
+    uint32_t checksum = wal_checksum(seed, header, offsetof(WalRecordHeader, checksum));
+    if (page != NULL) {
+        checksum = wal_checksum(checksum, page, wal_record_page_size(header));
+    }
+    return checksum;
+}
+
+void wal_sync_locked(Wal* wal) {
+    if (wal->synced_length == wal->file_length) {
+        wal->unsynced_commits = 0;
+        return;
+    }
+    if (fdatasync(wal->file_descriptor) == -1) {
+        printf("Error syncing log: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+    __atomic_store_n(&wal->synced_length, wal->file_length, __ATOMIC_RELEASE);
+    wal->unsynced_commits = 0;
+}
+
+void wal_sync(Wal* wal) {
+    pthread_mutex_lock(&wal->mutex);
+    wal_sync_locked(wal);
+    pthread_mutex_unlock(&wal->mutex);
+}
+
+/**
+ * Background thread of a log: a group of commits that does not fill up is
+ * still synced once its first commit is WAL_SYNC_INTERVAL_USEC old, even
+ * when no other commit follows.
+ **/
+void* wal_syncer(void* arg) {
+    Wal* wal = (Wal*)arg;
+    pthread_mutex_lock(&wal->mutex);
+    while (!wal->closing) {
+        if (wal->unsynced_commits == 0) {
+            pthread_cond_wait(&wal->unsynced, &wal->mutex);
+            continue;
+        }
+        uint64_t deadline = wal->first_unsynced_usec + WAL_SYNC_INTERVAL_USEC;
+        if (now_usec() >= deadline) {
+            wal_sync_locked(wal);
+            continue;
+        }
+        struct timespec until;
+        until.tv_sec = deadline / 1000000;
+        until.tv_nsec = (deadline % 1000000) * 1000;
+        pthread_cond_timedwait(&wal->unsynced, &wal->mutex, &until);
+    }
+    pthread_mutex_unlock(&wal->mutex);
+    return NULL;
+}
+
+void wal_truncate(Wal* wal) {
+    pthread_mutex_lock(&wal->mutex);
+    if (ftruncate(wal->file_descriptor, 0) == -1) {
+        printf("Error truncating log: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+    wal->file_length = 0;
+    __atomic_store_n(&wal->synced_length, 0, __ATOMIC_RELEASE);
+    wal->checksum = 0;
+    wal->unsynced_commits = 0;
+    pthread_mutex_unlock(&wal->mutex);
+}
+
+void wal_note_page(Wal* wal, uint32_t page_num) {
+    if (wal->num_pending > 0 && wal->pending[wal->num_pending - 1] == page_num) {
+        return;
+    }
+    if (wal->num_pending == wal->pending_capacity) {
+        wal->pending_capacity *= 2;
+        wal->pending = (uint32_t*) realloc(wal->pending, sizeof(uint32_t) * wal->pending_capacity);
+    }
+    wal->pending[wal->num_pending++] = page_num;
+}
+
+bool read_fully(int fd, void* buffer, size_t length, off_t offset) {
+    while (length > 0) {
+        ssize_t bytes_read = pread(fd, buffer, length, offset);
+        if (bytes_read <= 0) {
+            return false;
+        }
+        buffer = (char*)buffer + bytes_read;
+        length -= bytes_read;
+        offset += bytes_read;
+    }
+    return true;
+}
+
+void write_fully(int fd, const void* buffer, size_t length, off_t offset) {
+    while (length > 0) {
+        ssize_t bytes_written = pwrite(fd, buffer, length, offset);
+        if (bytes_written == -1) {
+            printf("Error writing: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+        buffer = (const char*)buffer + bytes_written;
+        length -= bytes_written;
+        offset += bytes_written;
+    }
+}
+
+/**
+ * Redo every complete commit in the log against the db file, then empty the log.
+ * A torn or corrupt record ends the log: the commit it belongs to never finished.
+ * Replay runs before the db file's header is read, so every record carries the
+ * page size.
+ **/
+void wal_replay(Wal* wal, int db_fd) {
+    uint64_t offset = 0;
+    uint64_t group_start = 0;
+    uint32_t checksum = 0;
+    uint32_t replayed_commits = 0;
+    void* page = malloc(MAX_PAGE_SIZE);
+    WalRecordHeader header;
+
+    while (read_fully(wal->file_descriptor, &header, sizeof(header), offset)) {
+        void* image = NULL;
+        uint32_t page_size = wal_record_page_size(&header);
+        if (header.type == WAL_RECORD_PAGE) {
+            if (page_size > MAX_PAGE_SIZE ||
+                !read_fully(wal->file_descriptor, page, page_size, offset + sizeof(header))) {
+                break;
+            }
+            image = page;
+        } else if (header.type != WAL_RECORD_COMMIT) {
+            break;
+        }
+        uint32_t expected = wal_record_checksum(checksum, &header, image);
+        if (expected != header.checksum) {
+            break;
+        }
+        checksum = expected;
+        offset += sizeof(header) + (image ? page_size : 0);
+
+        if (header.type == WAL_RECORD_COMMIT) {
+            // The whole group is known to be intact: copy its page images over
+            uint64_t record = group_start;
+            while (record < offset - sizeof(header)) {
+                WalRecordHeader page_header;
+                read_fully(wal->file_descriptor, &page_header, sizeof(page_header), record);
+                page_size = wal_record_page_size(&page_header);
+                read_fully(wal->file_descriptor, page, page_size, record + sizeof(page_header));
+                write_fully(db_fd, page, page_size, (off_t)page_header.page_num * page_size);
+                record += sizeof(page_header) + page_size;
+            }
+            group_start = offset;
+            replayed_commits++;
+        }
+    }
+    free(page);
+
+    if (replayed_commits > 0 && fsync(db_fd) == -1) {
+        printf("Error syncing db file: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+    wal_truncate(wal);
+}
+
+Wal* wal_open(const char* db_filename, int db_fd, uint32_t group_commit) {
+    Wal* wal = (Wal*) malloc(sizeof(Wal));
+    wal->filename = (char*) malloc(strlen(db_filename) + 5);
+    sprintf(wal->filename, "%s-wal", db_filename);
+
+    wal->file_descriptor = open(wal->filename, O_RDWR | O_CREAT, S_IWUSR | S_IRUSR);
+    if (wal->file_descriptor == -1) {
+        printf("Unable to open log file\n");
+        exit(EXIT_FAILURE);
+    }
+    wal->group_commit = group_commit > 0 ? group_commit : 1;
+    wal->first_unsynced_usec = 0;
+    wal->pending_capacity = 64;
+    wal->num_pending = 0;
+    wal->pending = (uint32_t*) malloc(sizeof(uint32_t) * wal->pending_capacity);
+    pthread_mutex_init(&wal->mutex, NULL);
+
+    wal_replay(wal, db_fd);
+    // Deadlines are on the clock now_usec reads
+    pthread_condattr_t unsynced_attr;
+    pthread_condattr_init(&unsynced_attr);
+    pthread_condattr_setclock(&unsynced_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&wal->unsynced, &unsynced_attr);
+    pthread_condattr_destroy(&unsynced_attr);
+    wal->closing = false;
+    pthread_create(&wal->syncer, NULL, wal_syncer, wal);
+    return wal;
+}
+
+void wal_close(Wal* wal) {
+    pthread_mutex_lock(&wal->mutex);
+    wal->closing = true;
+    pthread_cond_signal(&wal->unsynced);
+    pthread_mutex_unlock(&wal->mutex);
+    pthread_join(wal->syncer, NULL);
+    pthread_cond_destroy(&wal->unsynced);
+    close(wal->file_descriptor);
+    unlink(wal->filename);
+    free(wal->filename);
+    free(wal->pending);
+    pthread_mutex_destroy(&wal->mutex);
+    free(wal);
+}
+
+int compare_page_nums(const void* a, const void* b) {
+    uint32_t page_a = *(const uint32_t*)a;
+    uint32_t page_b = *(const uint32_t*)b;
+    return (page_a > page_b) - (page_a < page_b);
+}
+
+void pager_write_frame(Pager* pager, Frame* frame) {
+    page_seal(pager, frame->data);
+    stats_add(&pager->stats.pages_written, 1);
+    ssize_t bytes_written = pwrite(pager->file_descriptor, frame->data, PAGE_SIZE,
+                                   (off_t)frame->page_num * PAGE_SIZE);
+    if (bytes_written == -1) {
+        printf("Error writing: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * CLOCK replacement: sweep the frames, giving every referenced frame a second chance.
+ * Free frames are taken first. A dirty victim is written back before it is reused.
+ * Frames whose log record is not on disk yet are passed over: syncing the log
+ * must not hold up the pool, so when nothing else is left INVALID_FRAME is
+ * returned with needs_log_sync set. Called with the pool mutex held.
+ *
+ * The write-back does not hold up the pool either. The victim is pinned, so no
+ * other sweep takes it, and latched exclusively while the mutex is let go for
+ * the write: the writer pinning it meanwhile waits in get_page before it can
+ * change the page, and readers wait to copy it, as for a page being read in.
+ * The frame is only reused if nobody pinned it during the write.
+ **/
+uint32_t pager_find_victim(Pager* pager, bool* needs_log_sync) {
+    *needs_log_sync = false;
+    for (uint32_t step = 0; step < 2 * pager->num_frames; step++) {
+        uint32_t frame_num = pager->clock_hand;
+        Frame* frame = &pager->frames[frame_num];
+        pager->clock_hand = (pager->clock_hand + 1) % pager->num_frames;
+
+        if (frame->page_num == INVALID_PAGE_NUM) {
+            return frame_num;
+        }
+        if (frame->pin_count > 0) {
+            continue;
+        }
+        if (frame->dirty && frame->wal_lsn == WAL_LSN_PENDING) {
+            // Changed by the running statement: its log record does not exist yet
+            continue;
+        }
+        if (frame->referenced) {
+            frame->referenced = false;
+            continue;
+        }
+
+        if (frame->dirty) {
+            if (pager->wal != NULL &&
+                frame->wal_lsn > __atomic_load_n(&pager->wal->synced_length, __ATOMIC_ACQUIRE)) {
+                *needs_log_sync = true;
+                continue;
+            }
+            // Nobody holds the latch of a frame that was not pinned, so this never waits
+            frame->pin_count = 1;
+            pthread_rwlock_wrlock(&frame->latch);
+            pthread_mutex_unlock(&pager->mutex);
+            pager_write_frame(pager, frame);
+            pthread_mutex_lock(&pager->mutex);
+            // Still under the latch, so a later mark_page_dirty is not lost
+            frame->dirty = false;
+            frame->pin_count -= 1;
+            bool wanted = frame->pin_count > 0;
+            if (!wanted) {
+                page_table_remove(pager, frame->page_num);
+                frame->page_num = INVALID_PAGE_NUM;
+            }
+            pthread_rwlock_unlock(&frame->latch);
+            if (wanted) {
+                continue;
+            }
+            return frame_num;
+        }
+        page_table_remove(pager, frame->page_num);
+        frame->page_num = INVALID_PAGE_NUM;
+        return frame_num;
+    }
+    return INVALID_FRAME;
+}
+
+/**
+ * mmap methods
+ **/
+void pager_mmap_grow(Pager* pager, uint32_t page_num) {
+    uint32_t new_map_pages = pager->map_pages + MMAP_GROW_PAGES;
+    if (new_map_pages <= page_num) {
+        new_map_pages = page_num + 1;
+    }
+    if ((uint64_t)new_map_pages * PAGE_SIZE > MMAP_RESERVE_SIZE) {
+        printf("Db file outgrew the mmap reservation at page %d.\n", page_num);
+        exit(EXIT_FAILURE);
+    }
+
+    // The mapping already spans the whole reservation, so extending the file
+    // is enough to make the new pages accessible and existing pointers stay valid.
+    if (ftruncate(pager->file_descriptor, (off_t)new_map_pages * PAGE_SIZE) == -1) {
+        printf("Error growing db file: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+
+    uint32_t old_bytes = (pager->map_pages + 7) / 8;
+    uint32_t new_bytes = (new_map_pages + 7) / 8;
+    pager->map_dirty = (uint8_t*) realloc(pager->map_dirty, new_bytes);
+    memset(pager->map_dirty + old_bytes, 0, new_bytes - old_bytes);
+    pager->map_checked = (uint8_t*) realloc(pager->map_checked, new_bytes);
+    memset(pager->map_checked + old_bytes, 0, new_bytes - old_bytes);
+    pager->map_pages = new_map_pages;
+}
+
+void* pager_mmap_get_page(Pager* pager, uint32_t page_num) {
+    if (page_num >= pager->map_pages) {
+        pager_mmap_grow(pager, page_num);
+    }
+    if (page_num >= pager->num_pages) {
+        pager->num_pages = page_num + 1;
+    }
+    void* page = (char*)pager->map + (uint64_t)page_num * PAGE_SIZE;
+    stats_add(&pager->stats.page_hits, 1);
+    // Only the first access checks the page: it may be changed in place after that.
+    // Readers mark it at the same time, so the bit is set atomically.
+    uint8_t bit = 1 << (page_num % 8);
+    if (pager->checksums && !(__atomic_load_n(&pager->map_checked[page_num / 8], __ATOMIC_RELAXED) & bit)) {
+        page_verify(pager, page_num, page);
+        __atomic_fetch_or(&pager->map_checked[page_num / 8], bit, __ATOMIC_RELAXED);
+    }
+    // Converted in the private mapping on every read, until a change writes it out
+    node_upgrade_if_needed(page);
+    return page;
+}
+
+bool pager_mmap_is_dirty(Pager* pager, uint32_t page_num) {
+    return pager->map_dirty[page_num / 8] & (1 << (page_num % 8));
+}
+
+/**
+ * Write back each run of dirty pages with one pwrite straight from the mapping,
+ * then drop the private copies so later reads come from the page cache again.
+ **/
+void pager_mmap_flush_dirty(Pager* pager) {
+    uint32_t page_num = 0;
+    while (page_num < pager->num_pages) {
+        if (!pager_mmap_is_dirty(pager, page_num)) {
+            page_num++;
+            continue;
+        }
+        uint32_t first_page = page_num;
+        while (page_num < pager->num_pages && pager_mmap_is_dirty(pager, page_num)) {
+            pager->map_dirty[page_num / 8] &= ~(1 << (page_num % 8));
+            page_num++;
+        }
+
+        char* run = (char*)pager->map + (uint64_t)first_page * PAGE_SIZE;
+        size_t remaining = (size_t)(page_num - first_page) * PAGE_SIZE;
+        off_t offset = (off_t)first_page * PAGE_SIZE;
+        for (uint32_t i = 0; i < page_num - first_page; i++) {
+            page_seal(pager, run + (size_t)i * PAGE_SIZE);
+        }
+        stats_add(&pager->stats.pages_written, page_num - first_page);
+        while (remaining > 0) {
+            ssize_t bytes_written = pwrite(pager->file_descriptor, run, remaining, offset);
+            if (bytes_written == -1) {
+                printf("Error writing: %d\n", errno);
+                exit(EXIT_FAILURE);
+            }
+            run += bytes_written;
+            offset += bytes_written;
+            remaining -= bytes_written;
+        }
+        madvise((char*)pager->map + (uint64_t)first_page * PAGE_SIZE,
+                (size_t)(page_num - first_page) * PAGE_SIZE, MADV_DONTNEED);
+    }
+}
+
+/**
+ * Snapshots
+ * Statements may run on several threads at once, one of them writing (see
+ * table_begin_write). Each write statement is published as a new version when
+ * it ends, and a reader sees the table as of the version current when its own
+ * statement began, however long it runs.
+ *
+ * The writer changes pages in place. Before a statement first changes a page,
+ * the page's image goes into the version store for the running snapshots, and
+ * the frame's version moves past all of them. A reader takes a private copy of
+ * the image its snapshot sees, from the frame or from the store, so the writer
+ * only ever waits for a copy to finish, never for a statement.
+ *
+ * Frame latches cover the copies: a reader copies under a shared latch, which
+ * the writer takes exclusively once before changing the page, just to let
+ * copies already under way finish. A thread reading a page in holds it
+ * exclusively too.
+ *
+ * Images older than every running snapshot are dropped. When no reader is about
+ * the writer keeps none, and a reader starting meanwhile waits for the
+ * statement to be published.
+ **/
+typedef enum {
+    PAGE_ACCESS_DIRECT,     // pages used in place: the default, and while the table is held exclusively
+    PAGE_ACCESS_SNAPSHOT,   // a reader, between table_begin_read and table_end_read
+    PAGE_ACCESS_WRITER      // the writer, between table_begin_write and table_end_write
+} PageAccess;
+
+static __thread PageAccess thread_page_access = PAGE_ACCESS_DIRECT;
+static __thread uint64_t thread_snapshot;
+
+// A reader's copy of a page, shared by its get_page calls until the last unpin_page
+typedef struct {
+    uint32_t page_num;
+    uint32_t refs;
+    void* data;
+} SnapshotPage;
+
+static __thread SnapshotPage thread_pages[SNAPSHOT_MAX_PAGES];
+static __thread uint32_t thread_num_pages = 0;
+
+// The kept image of page_num that snapshot sees, NULL when it sees the frame's
+PageVersion* version_find(Pager* pager, uint32_t page_num, uint64_t snapshot) {
+    PageVersion* version = pager->versions[page_table_slot(pager, page_num)];
+    for (; version != NULL; version = version->next) {
+        if (version->page_num == page_num && version->begin <= snapshot && snapshot < version->end) {
+            return version;
+        }
+    }
+    return NULL;
+}
+
+// The version of page_num's latest image: where the last kept one ends
+uint64_t version_latest(Pager* pager, uint32_t page_num) {
+    uint64_t latest = 0;
+    PageVersion* version = pager->versions[page_table_slot(pager, page_num)];
+    for (; version != NULL; version = version->next) {
+        if (version->page_num == page_num && version->end > latest) {
+            latest = version->end;
+        }
+    }
+    return latest;
+}
+
+// Keep the image of the frame for the snapshots before end
+void version_save(Pager* pager, Frame* frame, uint64_t end) {
+    PageVersion* version = (PageVersion*) malloc(sizeof(PageVersion));
+    version->page_num = frame->page_num;
+    version->begin = frame->version;
+    version->end = end;
+    version->data = malloc(PAGE_SIZE);
+    memcpy(version->data, frame->data, PAGE_SIZE);
+    uint32_t slot = page_table_slot(pager, frame->page_num);
+    version->next = pager->versions[slot];
+    pager->versions[slot] = version;
+    pager->num_versions += 1;
+}
+
+// Drop the images no running snapshot sees
+void version_prune(Pager* pager) {
+    if (pager->num_versions == 0) {
+        return;
+    }
+    uint64_t oldest = pager->num_snapshots > 0 ? pager->snapshots[0] : UINT64_MAX;
+    for (uint32_t slot = 0; slot <= pager->page_table_mask; slot++) {
+        PageVersion** link = &pager->versions[slot];
+        while (*link != NULL) {
+            PageVersion* version = *link;
+            if (version->end > oldest) {
+                link = &version->next;
+                continue;
+            }
+            *link = version->next;
+            free(version->data);
+            free(version);
+            pager->num_versions -= 1;
+        }
+    }
+}
+
+/**
+ * Start a snapshot for the calling thread at the latest published version.
+ **/
+void pager_begin_snapshot(Pager* pager) {
+    pthread_mutex_lock(&pager->mutex);
+    // Pages the running statement changes have no earlier image to read
+    while (pager->unpublished && !pager->versioned) {
+        pthread_cond_wait(&pager->published, &pager->mutex);
+    }
+    if (pager->num_snapshots == pager->snapshots_capacity) {
+        pager->snapshots_capacity *= 2;
+        pager->snapshots = (uint64_t*) realloc(pager->snapshots, sizeof(uint64_t) * pager->snapshots_capacity);
+    }
+    // Versions only grow, so the list stays oldest first
+    thread_snapshot = pager->version;
+    pager->snapshots[pager->num_snapshots++] = thread_snapshot;
+    pthread_mutex_unlock(&pager->mutex);
+}
+
+void pager_end_snapshot(Pager* pager) {
+    pthread_mutex_lock(&pager->mutex);
+    uint32_t i = 0;
+    while (pager->snapshots[i] != thread_snapshot) {
+        i++;
+    }
+    memmove(&pager->snapshots[i], &pager->snapshots[i + 1],
+            sizeof(uint64_t) * (pager->num_snapshots - i - 1));
+    pager->num_snapshots -= 1;
+    if (pager->num_snapshots == 0) {
+        // The images of the running statement go too, so new readers wait for it
+        pager->versioned = false;
+    }
+    if (i == 0) {
+        version_prune(pager);
+    }
+    pthread_mutex_unlock(&pager->mutex);
+}
+
+/**
+ * Pin the frame holding page_num, reading the page in when it is missing.
+ * It is read under an exclusive latch on its new frame, so threads finding
+ * it in the page table meanwhile wait for the read.
+ **/
+Frame* pager_pin(Pager* pager, uint32_t page_num) {
+    Frame* frame;
+    bool loading = false;
+    pthread_mutex_lock(&pager->mutex);
+    while (true) {
+        uint32_t frame_num = page_table_find(pager, page_num);
+        if (frame_num != INVALID_FRAME) { // CACHE
+            frame = &pager->frames[frame_num];
+            frame->pin_count += 1;
+            frame->referenced = true;
+            stats_add(&pager->stats.page_hits, 1);
+            break;
+        }
+
+        // Cache miss. Take a frame and load from file.
+        bool needs_log_sync;
+        frame_num = pager_find_victim(pager, &needs_log_sync);
+        if (frame_num != INVALID_FRAME) {
+            frame = &pager->frames[frame_num];
+            frame->page_num = page_num;
+            frame->pin_count = 1;
+            frame->referenced = true;
+            frame->dirty = false;
+            frame->wal_lsn = 0;
+            frame->version = version_latest(pager, page_num);
+            page_table_insert(pager, page_num, frame_num);
+            if (page_num >= pager->num_pages) {
+                pager->num_pages = page_num + 1;
+            }
+            // Nobody holds the latch of a frame that was not pinned, so this never waits
+            pthread_rwlock_wrlock(&frame->latch);
+            loading = true;
+            stats_add(&pager->stats.page_misses, 1);
+            break;
+        }
+        if (!needs_log_sync) {
+            printf("Buffer pool exhausted: all %d frames are pinned or hold uncommitted changes.\n",
+                   pager->num_frames);
+            exit(EXIT_FAILURE);
+        }
+        // Another thread may load the page while the log is synced, so look again after
+        pthread_mutex_unlock(&pager->mutex);
+        wal_sync(pager->wal);
+        pthread_mutex_lock(&pager->mutex);
+    }
+    pthread_mutex_unlock(&pager->mutex);
+
+    if (loading) {
+        // Pages past the end of the file (new, or never written back) read as zeros.
+        // The file is whole pages, so anything but a full page or none is a torn file.
+        ssize_t bytes_read = pread(pager->file_descriptor, frame->data, PAGE_SIZE,
+                                   (off_t)page_num * PAGE_SIZE);
+        if (bytes_read == -1) {
+            printf("Error reading file: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+        if (bytes_read == 0) {
+            memset(frame->data, 0, PAGE_SIZE);
+        } else if (bytes_read < PAGE_SIZE) {
+            printf("Page %d is corrupt: read %d of its bytes.\n", page_num, (int)bytes_read);
+            exit(EXIT_FAILURE);
+        } else {
+            page_verify(pager, page_num, frame->data);
+        }
+        stats_add(&pager->stats.pages_read, 1);
+        node_upgrade_if_needed(frame->data);
+        pthread_rwlock_unlock(&frame->latch);
+    }
+    return frame;
+}
+
+/**
+ * Copy the image of a pinned frame's page that the thread's snapshot sees,
+ * and give the pin back.
+ **/
+void* pager_snapshot_copy(Pager* pager, Frame* frame) {
+    void* copy = malloc(PAGE_SIZE);
+    pthread_mutex_lock(&pager->mutex);
+    while (frame->version <= thread_snapshot) {
+        pthread_mutex_unlock(&pager->mutex);
+        if (pthread_rwlock_tryrdlock(&frame->latch) == 0) {
+            pthread_mutex_lock(&pager->mutex);
+            bool visible = frame->version <= thread_snapshot;
+            pthread_mutex_unlock(&pager->mutex);
+            if (visible) {
+                // The writer moves the version on before it waits for the latch.
+                // It may still seal the page, so the checksum is left out.
+                memcpy(copy, frame->data, PAGE_USABLE_SIZE);
+            }
+            pthread_rwlock_unlock(&frame->latch);
+            pthread_mutex_lock(&pager->mutex);
+            if (visible) {
+                frame->pin_count -= 1;
+                pthread_mutex_unlock(&pager->mutex);
+                return copy;
+            }
+            break;
+        }
+        // Being read in, or the writer has just taken it and saved its image
+        sched_yield();
+        pthread_mutex_lock(&pager->mutex);
+    }
+    PageVersion* version = version_find(pager, frame->page_num, thread_snapshot);
+    if (version == NULL) {
+        printf("No image of page %d for snapshot %llu.\n", frame->page_num,
+               (unsigned long long)thread_snapshot);
+        exit(EXIT_FAILURE);
+    }
+    memcpy(copy, version->data, PAGE_SIZE);
+    frame->pin_count -= 1;
+    pthread_mutex_unlock(&pager->mutex);
+    return copy;
+}
+
+/**
+ * Return the page pinned in the buffer pool.
+ * Every get_page must be paired with an unpin_page once the caller
+ * stops using the returned pointer. A reader gets its own copy of the
+ * page as its snapshot sees it, see "Snapshots".
+ **/
+void* get_page(Pager* pager, uint32_t page_num) {
+    if (pager->use_mmap) {
+        pthread_mutex_lock(&pager->mutex);
+        void* page = pager_mmap_get_page(pager, page_num);
+        pthread_mutex_unlock(&pager->mutex);
+        return page;
+    }
+
+    if (thread_page_access == PAGE_ACCESS_SNAPSHOT) {
+        for (uint32_t i = 0; i < thread_num_pages; i++) {
+            if (thread_pages[i].page_num == page_num) {
+                thread_pages[i].refs += 1;
+                return thread_pages[i].data;
+            }
+        }
+        if (thread_num_pages == SNAPSHOT_MAX_PAGES) {
+            printf("A reader may hold at most %d pages.\n", SNAPSHOT_MAX_PAGES);
+            exit(EXIT_FAILURE);
+        }
+        SnapshotPage* page = &thread_pages[thread_num_pages++];
+        page->page_num = page_num;
+        page->refs = 1;
+        page->data = pager_snapshot_copy(pager, pager_pin(pager, page_num));
+        return page->data;
+    }
+
+    Frame* frame = pager_pin(pager, page_num);
+    if (thread_page_access == PAGE_ACCESS_WRITER) {
+        // A reader may still be reading the page in
+        pthread_rwlock_rdlock(&frame->latch);
+        pthread_rwlock_unlock(&frame->latch);
+    }
+    return frame->data;
+}
+
+void unpin_page(Pager* pager, uint32_t page_num) {
+    if (pager->use_mmap) {
+        return;
+    }
+    if (thread_page_access == PAGE_ACCESS_SNAPSHOT) {
+        for (uint32_t i = 0; i < thread_num_pages; i++) {
+            if (thread_pages[i].page_num == page_num) {
+                if (--thread_pages[i].refs == 0) {
+                    free(thread_pages[i].data);
+                    thread_pages[i] = thread_pages[--thread_num_pages];
+                }
+                return;
+            }
+        }
+        printf("Tried to unpin page %d which is not pinned\n", page_num);
+        exit(EXIT_FAILURE);
+    }
+    pthread_mutex_lock(&pager->mutex);
+    uint32_t frame_num = page_table_find(pager, page_num);
+    if (frame_num == INVALID_FRAME || pager->frames[frame_num].pin_count == 0) {
+        printf("Tried to unpin page %d which is not pinned\n", page_num);
+        exit(EXIT_FAILURE);
+    }
+    pager->frames[frame_num].pin_count -= 1;
+    pthread_mutex_unlock(&pager->mutex);
+}
+
+/**
+ * Call before modifying a pinned page, so the change is written back
+ * on eviction or flush. Pages that were only read are never written.
+ **/
+void mark_page_dirty(Pager* pager, uint32_t page_num) {
+    bool logged = pager->wal != NULL && !pager->skip_wal;
+    if (logged) {
+        wal_note_page(pager->wal, page_num);
+    }
+    if (pager->use_mmap) {
+        pager->map_dirty[page_num / 8] |= 1 << (page_num % 8);
+        return;
+    }
+    pthread_mutex_lock(&pager->mutex);
+    uint32_t frame_num = page_table_find(pager, page_num);
+    if (frame_num == INVALID_FRAME || pager->frames[frame_num].pin_count == 0) {
+        printf("Tried to dirty page %d which is not pinned\n", page_num);
+        exit(EXIT_FAILURE);
+    }
+    Frame* frame = &pager->frames[frame_num];
+    frame->dirty = true;
+    if (logged) {
+        frame->wal_lsn = WAL_LSN_PENDING;
+    }
+    // The first change the statement makes to the page
+    bool first = thread_page_access == PAGE_ACCESS_WRITER && frame->version != pager->version + 1;
+    if (first) {
+        if (!pager->unpublished) {
+            pager->unpublished = true;
+            pager->versioned = pager->num_snapshots > 0;
+        }
+        if (pager->versioned) {
+            version_save(pager, frame, pager->version + 1);
+        }
+        // Running snapshots read the saved image from now on
+        frame->version = pager->version + 1;
+    }
+    pthread_mutex_unlock(&pager->mutex);
+
+    if (first) {
+        // Readers that were copying the page finish, later ones look at the version first
+        pthread_rwlock_wrlock(&frame->latch);
+        pthread_rwlock_unlock(&frame->latch);
+    }
+}
+
+/**
+ * The writer is done with a statement: its changes become the next version.
+ **/
+void pager_publish(Pager* pager) {
+    pthread_mutex_lock(&pager->mutex);
+    if (pager->unpublished) {
+        pager->version += 1;
+        pager->unpublished = false;
+        pthread_cond_broadcast(&pager->published);
+        if (pager->num_snapshots == 0) {
+            // The readers the statement kept images for are gone
+            version_prune(pager);
+        }
+    }
+    pthread_mutex_unlock(&pager->mutex);
+}
+
+/**
+ * Ask the kernel to start reading pages that will be needed soon.
+ * Pages already in the buffer pool are skipped, and runs of neighbouring pages
+ * are requested together. The reads run asynchronously in the page cache,
+ * so the later get_page only pays for a copy (or nothing in mmap mode).
+ **/
+void pager_prefetch(Pager* pager, uint32_t* page_nums, uint32_t count) {
+    uint32_t* wanted = (uint32_t*) malloc(sizeof(uint32_t) * count);
+    uint32_t num_wanted = 0;
+    pthread_mutex_lock(&pager->mutex);
+    for (uint32_t i = 0; i < count; i++) {
+        if (page_nums[i] >= pager->num_pages) {
+            continue;
+        }
+        if (!pager->use_mmap && page_table_find(pager, page_nums[i]) != INVALID_FRAME) {
+            continue;
+        }
+        wanted[num_wanted++] = page_nums[i];
+    }
+    pthread_mutex_unlock(&pager->mutex);
+    qsort(wanted, num_wanted, sizeof(uint32_t), compare_page_nums);
+
+    uint32_t run_start = 0;
+    while (run_start < num_wanted) {
+        uint32_t run_length = 1;
+        while (run_start + run_length < num_wanted &&
+               wanted[run_start + run_length] == wanted[run_start] + run_length) {
+            run_length++;
+        }
+        off_t offset = (off_t)wanted[run_start] * PAGE_SIZE;
+        size_t length = (size_t)run_length * PAGE_SIZE;
+        if (pager->use_mmap) {
+            madvise((char*)pager->map + offset, length, MADV_WILLNEED);
+        } else {
+            posix_fadvise(pager->file_descriptor, offset, length, POSIX_FADV_WILLNEED);
+        }
+        run_start += run_length;
+    }
+    free(wanted);
+}
+
+bool page_size_is_valid(uint32_t page_size) {
+    return page_size >= MIN_PAGE_SIZE && page_size <= MAX_PAGE_SIZE && (page_size & (page_size - 1)) == 0;
+}
+
+/**
+ * Format and page size of an existing db file, from the header in its meta
+ * page. Only that page is read, the others are checked as they are read in.
+ * The header fits into the smallest page, so that much is read first.
+ **/
+uint32_t file_read_format(int fd, uint32_t* page_size) {
+    void* meta = malloc(MAX_PAGE_SIZE);
+    if (!read_fully(fd, meta, MIN_PAGE_SIZE, 0)) {
+        printf("Db file is not a whole number of pages. Corrupt file.\n");
+        exit(EXIT_FAILURE);
+    }
+    // Files written before the header existed have none, and those written
+    // before the meta page have the root in page 0
+    char no_magic[FILE_MAGIC_SIZE] = {0};
+    bool has_header = *meta_marker(meta) == META_PAGE_MARKER &&
+                      memcmp(meta_magic(meta), no_magic, FILE_MAGIC_SIZE) != 0;
+    uint32_t format_version = FILE_FORMAT_UNCHECKED;
+    *page_size = LEGACY_PAGE_SIZE;
+    if (has_header) {
+        if (memcmp(meta_magic(meta), FILE_MAGIC, FILE_MAGIC_SIZE) != 0) {
+            printf("Not a db file: the header has no magic.\n");
+            exit(EXIT_FAILURE);
+        }
+        format_version = *meta_format_version(meta);
+        if (format_version == 0 || format_version > FILE_FORMAT_CURRENT) {
+            printf("Db file has format version %d, this build reads up to %d.\n",
+                   format_version, FILE_FORMAT_CURRENT);
+            exit(EXIT_FAILURE);
+        }
+        *page_size = *meta_page_size(meta);
+        if (!page_size_is_valid(*page_size)) {
+            printf("Db file has pages of %d bytes. Corrupt file.\n", *page_size);
+            exit(EXIT_FAILURE);
+        }
+        if (!read_fully(fd, meta, *page_size, 0)) {
+            printf("Db file is not a whole number of pages. Corrupt file.\n");
+            exit(EXIT_FAILURE);
+        }
+        uint32_t usable_size = *page_size - PAGE_CHECKSUM_SIZE;
+        if (format_version >= FILE_FORMAT_CHECKSUMS &&
+            crc32c(meta, usable_size) != *(uint32_t*)(meta + usable_size)) {
+            printf("Page %d is corrupt: checksum mismatch.\n", META_PAGE_NUM);
+            exit(EXIT_FAILURE);
+        }
+    }
+    free(meta);
+    return format_version;
+}
+
+Pager* pager_open(const char* filename, PagerConfig* config) {
+    int fd = open(filename, 
+                  O_RDWR | // Read and Write mode
+                  O_CREAT, // Create file if it doesn't exist
+                  S_IWUSR| // User write permission
+                  S_IRUSR  // User read permission
+                 );
+    if (fd == -1) {
+        printf("Unable to open file(db)\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Recovery runs before anything looks at the file. A log left behind by an
+    // earlier session is replayed even when this one runs without a log.
+    Wal* wal = NULL;
+    if (config->use_wal) {
+        wal = wal_open(filename, fd, config->wal_group_commit);
+    } else {
+        char* wal_filename = (char*) malloc(strlen(filename) + 5);
+        sprintf(wal_filename, "%s-wal", filename);
+        if (access(wal_filename, F_OK) == 0) {
+            wal_close(wal_open(filename, fd, 1));
+        }
+        free(wal_filename);
+    }
+    uint32_t num_frames = config->use_mmap ? 0 : config->num_frames;
+    if (!config->use_mmap && (num_frames < MIN_POOL_FRAMES || num_frames > MAX_POOL_FRAMES)) {
+        printf("Buffer pool needs from %d to %d frames.\n", MIN_POOL_FRAMES, MAX_POOL_FRAMES);
+        exit(EXIT_FAILURE);
+    }
+
+    off_t file_length = lseek(fd, 0, SEEK_END); // WHAT IS OFF_T?
+    Pager* pager = (Pager*) malloc(sizeof(Pager));
+
+    pager->file_descriptor = fd;
+    pager->file_length = file_length;
+
+    // A new file gets the page size asked for, an existing one keeps its own
+    pthread_once(&crc32c_once, crc32c_init);
+    uint32_t page_size = config->page_size;
+    if (file_length == 0) {
+        if (!page_size_is_valid(page_size)) {
+            printf("Page size must be a power of two from %d to %d.\n", MIN_PAGE_SIZE, MAX_PAGE_SIZE);
+            exit(EXIT_FAILURE);
+        }
+        pager->format_version = FILE_FORMAT_CURRENT;
+    } else {
+        pager->format_version = file_read_format(fd, &page_size);
+    }
+    pager->checksums = pager->format_version >= FILE_FORMAT_CHECKSUMS;
+    page_layout_init(page_size, pager->checksums ? page_size - PAGE_CHECKSUM_SIZE : page_size);
+    num_open_pagers++;
+
+    pager->num_pages = (file_length / PAGE_SIZE);
+
+    if (file_length % PAGE_SIZE != 0) {
+        printf("Db file is not a whole number of pages. Corrupt file.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    pager->num_frames = num_frames;
+    pager->clock_hand = 0;
+    pager->frames = (Frame*) malloc(sizeof(Frame) * num_frames);
+    if (pager->frames == NULL) {
+        printf("Unable to allocate %d frames.\n", num_frames);
+        exit(EXIT_FAILURE);
+    }
+    // Readers queue up behind a waiting writer, or a steady stream of them could starve it
+    pthread_rwlockattr_t latch_attr;
+    pthread_rwlockattr_init(&latch_attr);
+    pthread_rwlockattr_setkind_np(&latch_attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    for (uint32_t i = 0; i < num_frames; i++) {
+        pager->frames[i].page_num = INVALID_PAGE_NUM;
+        pager->frames[i].pin_count = 0;
+        pager->frames[i].referenced = false;
+        pager->frames[i].dirty = false;
+        pager->frames[i].wal_lsn = 0;
+        pager->frames[i].data = malloc(PAGE_SIZE);
+        if (pager->frames[i].data == NULL) {
+            printf("Unable to allocate %d frames.\n", num_frames);
+            exit(EXIT_FAILURE);
+        }
+        pager->frames[i].version = 0;
+        pthread_rwlock_init(&pager->frames[i].latch, &latch_attr);
+    }
+    pthread_rwlockattr_destroy(&latch_attr);
+    pthread_mutex_init(&pager->mutex, NULL);
+
+    // Keep the page table at most half full so probe runs stay short
+    uint32_t table_size = 2;
+    while (table_size < 2 * num_frames) {
+        table_size *= 2;
+    }
+    pager->page_table_mask = table_size - 1;
+    pager->page_table = (uint32_t*) malloc(sizeof(uint32_t) * table_size);
+    pager->versions = (PageVersion**) calloc(table_size, sizeof(PageVersion*));
+    if (pager->page_table == NULL || pager->versions == NULL) {
+        printf("Unable to allocate the page table for %d frames.\n", num_frames);
+        exit(EXIT_FAILURE);
+    }
+    for (uint32_t i = 0; i < table_size; i++) {
+        pager->page_table[i] = INVALID_FRAME;
+    }
+    pager->num_versions = 0;
+    pager->version = 0;
+    pager->unpublished = false;
+    pager->versioned = false;
+    pthread_cond_init(&pager->published, NULL);
+    pager->snapshots_capacity = 4;
+    pager->snapshots = (uint64_t*) malloc(sizeof(uint64_t) * pager->snapshots_capacity);
+    pager->num_snapshots = 0;
+
+    pager->wal = wal;
+    pager->skip_wal = false;
+    memset(&pager->stats, 0, sizeof(Stats));
+    pager->readahead_pages = config->readahead_pages;
+    pager->use_mmap = config->use_mmap;
+    pager->map = NULL;
+    pager->map_pages = pager->num_pages;
+    pager->map_dirty = NULL;
+    pager->map_checked = NULL;
+    if (pager->use_mmap) {
+        // Reserve the whole range up front: growing never has to move the mapping,
+        // so page pointers handed out earlier remain valid.
+        pager->map = mmap(NULL, MMAP_RESERVE_SIZE, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_NORESERVE, fd, 0);
+        if (pager->map == MAP_FAILED) {
+            printf("Unable to map db file: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+        pager->map_dirty = (uint8_t*) calloc((pager->map_pages + 7) / 8 + 1, 1);
+        pager->map_checked = (uint8_t*) calloc((pager->map_pages + 7) / 8 + 1, 1);
+    }
+    return pager;
+}
+
+void pager_flush(Pager* pager, uint32_t page_num) {
+    if (pager->use_mmap) {
+        page_seal(pager, (char*)pager->map + (uint64_t)page_num * PAGE_SIZE);
+        stats_add(&pager->stats.pages_written, 1);
+        ssize_t bytes_written = pwrite(pager->file_descriptor,
+                                       (char*)pager->map + (uint64_t)page_num * PAGE_SIZE,
+                                       PAGE_SIZE, (off_t)page_num * PAGE_SIZE);
+        if (bytes_written == -1) {
+            printf("Error writing: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+        pager->map_dirty[page_num / 8] &= ~(1 << (page_num % 8));
+        return;
+    }
+    uint32_t frame_num = page_table_find(pager, page_num);
+    if (frame_num == INVALID_FRAME) {
+        printf("Tried to flush null page\n");
+        exit(EXIT_FAILURE);
+    }
+    pager_write_frame(pager, &pager->frames[frame_num]);
+    pager->frames[frame_num].dirty = false;
+}
+
+int compare_frames_by_page(const void* a, const void* b, void* arg) {
+    Frame* frames = (Frame*)arg;
+    uint32_t page_a = frames[*(const uint32_t*)a].page_num;
+    uint32_t page_b = frames[*(const uint32_t*)b].page_num;
+    return (page_a > page_b) - (page_a < page_b);
+}
+
+/**
+ * Write every dirty page back to the file.
+ * Dirty pages are sorted by page number and each run of contiguous pages
+ * goes out as a single pwritev, so a checkpoint costs one syscall per run.
+ **/
+void pager_flush_dirty(Pager* pager) {
+    if (pager->use_mmap) {
+        pager_mmap_flush_dirty(pager);
+        return;
+    }
+    pthread_mutex_lock(&pager->mutex);
+    uint32_t* dirty_frames = (uint32_t*) malloc(sizeof(uint32_t) * pager->num_frames);
+    uint32_t num_dirty = 0;
+    for (uint32_t i = 0; i < pager->num_frames; i++) {
+        if (pager->frames[i].page_num != INVALID_PAGE_NUM && pager->frames[i].dirty) {
+            dirty_frames[num_dirty++] = i;
+        }
+    }
+    qsort_r(dirty_frames, num_dirty, sizeof(uint32_t), compare_frames_by_page, pager->frames);
+
+    struct iovec iov[IOV_MAX];
+    uint32_t run_start = 0;
+    while (run_start < num_dirty) {
+        uint32_t first_page = pager->frames[dirty_frames[run_start]].page_num;
+        uint32_t run_length = 0;
+        while (run_start + run_length < num_dirty && run_length < IOV_MAX &&
+               pager->frames[dirty_frames[run_start + run_length]].page_num == first_page + run_length) {
+            iov[run_length].iov_base = pager->frames[dirty_frames[run_start + run_length]].data;
+            iov[run_length].iov_len = PAGE_SIZE;
+            page_seal(pager, iov[run_length].iov_base);
+            run_length++;
+        }
+
+        off_t offset = (off_t)first_page * PAGE_SIZE;
+        size_t remaining = (size_t)run_length * PAGE_SIZE;
+        stats_add(&pager->stats.pages_written, run_length);
+        struct iovec* next = iov;
+        int iov_count = run_length;
+        while (remaining > 0) {
+            ssize_t bytes_written = pwritev(pager->file_descriptor, next, iov_count, offset);
+            if (bytes_written == -1) {
+                printf("Error writing: %d\n", errno);
+                exit(EXIT_FAILURE);
+            }
+            // Short write: skip the bytes that made it and retry the rest
+            offset += bytes_written;
+            remaining -= bytes_written;
+            while (iov_count > 0 && (size_t)bytes_written >= next->iov_len) {
+                bytes_written -= next->iov_len;
+                next++;
+                iov_count--;
+            }
+            if (iov_count > 0) {
+                next->iov_base = (char*)next->iov_base + bytes_written;
+                next->iov_len -= bytes_written;
+            }
+        }
+
+        for (uint32_t i = 0; i < run_length; i++) {
+            pager->frames[dirty_frames[run_start + i]].dirty = false;
+        }
+        run_start += run_length;
+    }
+    free(dirty_frames);
+    pthread_mutex_unlock(&pager->mutex);
+}
+
+void* pager_page_data(Pager* pager, uint32_t page_num) {
+    if (pager->use_mmap) {
+        return (char*)pager->map + (uint64_t)page_num * PAGE_SIZE;
+    }
+    pthread_mutex_lock(&pager->mutex);
+    void* data = pager->frames[page_table_find(pager, page_num)].data;
+    pthread_mutex_unlock(&pager->mutex);
+    return data;
+}
+
+/**
+ * Make everything written to the db file so far durable and empty the log.
+ **/
+void pager_checkpoint(Pager* pager) {
+    Wal* wal = pager->wal;
+    wal_sync(wal);
+    pager_flush_dirty(pager);
+    if (fsync(pager->file_descriptor) == -1) {
+        printf("Error syncing db file: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+    wal_truncate(wal);
+    stats_add(&pager->stats.checkpoints, 1);
+}
+
+/**
+ * Uncommitted pages cannot leave the pool, so a statement touching many pages
+ * has to commit part way before they fill it. Commits only happen between
+ * rows, so there must always be room for the next row's ROW_MAX_DIRTY_PAGES,
+ * which is why pools under MIN_POOL_FRAMES are turned down.
+ **/
+bool pager_commit_due(Pager* pager) {
+    if (pager->wal == NULL || pager->use_mmap) {
+        return false;
+    }
+    uint32_t num_pending = pager->wal->num_pending;
+    return num_pending >= pager->num_frames / 2 ||
+           num_pending + ROW_MAX_DIRTY_PAGES + POOL_PIN_RESERVE > pager->num_frames;
+}
+
+/**
+ * End of a statement: log the image of every page it modified and a commit record
+ * in one sequential append. The fsync is shared by a group of commits, it runs
+ * here once WAL_GROUP_COMMIT commits have piled up, or from wal_syncer once
+ * the oldest one is WAL_SYNC_INTERVAL_USEC old, so a crash of the machine
+ * (not of the process) can lose at most that window, plus the time the fsync
+ * itself takes.
+ **/
+void pager_commit(Pager* pager) {
+    Wal* wal = pager->wal;
+    if (wal == NULL || wal->num_pending == 0) {
+        return;
+    }
+    // Taken before the pool mutex, never after it
+    pthread_mutex_lock(&wal->mutex);
+
+    qsort(wal->pending, wal->num_pending, sizeof(uint32_t), compare_page_nums);
+    uint32_t num_pages = 0;
+    for (uint32_t i = 0; i < wal->num_pending; i++) {
+        if (num_pages == 0 || wal->pending[num_pages - 1] != wal->pending[i]) {
+            wal->pending[num_pages++] = wal->pending[i];
+        }
+    }
+
+    // Page records go out in batches of IOV_MAX / 2 (header + image each),
+    // followed by the commit record that makes the group visible to recovery.
+    WalRecordHeader headers[IOV_MAX / 2 + 1];
+    struct iovec iov[IOV_MAX];
+    uint32_t next = 0;
+    while (next <= num_pages) {
+        int iov_count = 0;
+        uint32_t batch = 0;
+        while (next < num_pages && iov_count + 2 <= IOV_MAX) {
+            uint32_t page_num = wal->pending[next];
+            void* data = pager_page_data(pager, page_num);
+            // Sealed before it is logged, recovery copies the image as it is
+            page_seal(pager, data);
+            WalRecordHeader* header = &headers[batch++];
+            header->type = WAL_RECORD_PAGE;
+            header->page_num = page_num;
+            header->page_size = PAGE_SIZE;
+            header->checksum = wal_record_checksum(wal->checksum, header, data);
+            wal->checksum = header->checksum;
+
+            iov[iov_count].iov_base = header;
+            iov[iov_count++].iov_len = sizeof(WalRecordHeader);
+            iov[iov_count].iov_base = data;
+            iov[iov_count++].iov_len = PAGE_SIZE;
+
+            uint64_t lsn = wal->file_length + (uint64_t)batch * (sizeof(WalRecordHeader) + PAGE_SIZE);
+            if (!pager->use_mmap) {
+                // Evicting the page now has to sync the log, which waits for this append
+                pthread_mutex_lock(&pager->mutex);
+                pager->frames[page_table_find(pager, page_num)].wal_lsn = lsn;
+                pthread_mutex_unlock(&pager->mutex);
+            }
+            next++;
+        }
+        if (next == num_pages && iov_count + 1 <= IOV_MAX) {
+            WalRecordHeader* header = &headers[batch];
+            header->type = WAL_RECORD_COMMIT;
+            header->page_num = pager->num_pages;
+            header->page_size = PAGE_SIZE;
+            header->checksum = wal_record_checksum(wal->checksum, header, NULL);
+            wal->checksum = header->checksum;
+            iov[iov_count].iov_base = header;
+            iov[iov_count++].iov_len = sizeof(WalRecordHeader);
+            next++;
+        }
+
+        size_t length = 0;
+        for (int i = 0; i < iov_count; i++) {
+            length += iov[i].iov_len;
+        }
+        ssize_t bytes_written = pwritev(wal->file_descriptor, iov, iov_count, wal->file_length);
+        if (bytes_written == -1) {
+            printf("Error writing log: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+        if ((size_t)bytes_written < length) {
+            // Rare short write: fall back to writing the rest piece by piece
+            size_t skip = bytes_written;
+            off_t offset = wal->file_length + bytes_written;
+            for (int i = 0; i < iov_count; i++) {
+                if (skip >= iov[i].iov_len) {
+                    skip -= iov[i].iov_len;
+                    continue;
+                }
+                write_fully(wal->file_descriptor, (char*)iov[i].iov_base + skip,
+                            iov[i].iov_len - skip, offset);
+                offset += iov[i].iov_len - skip;
+                skip = 0;
+            }
+        }
+        wal->file_length += length;
+    }
+    wal->num_pending = 0;
+    stats_add(&pager->stats.pages_logged, num_pages);
+    stats_add(&pager->stats.commits, 1);
+
+    uint64_t now = now_usec();
+    if (wal->unsynced_commits == 0) {
+        wal->first_unsynced_usec = now;
+    }
+    wal->unsynced_commits++;
+    if (wal->unsynced_commits >= wal->group_commit ||
+        now - wal->first_unsynced_usec >= WAL_SYNC_INTERVAL_USEC) {
+        wal_sync_locked(wal);
+    } else if (wal->unsynced_commits == 1) {
+        pthread_cond_signal(&wal->unsynced);
+    }
+    pthread_mutex_unlock(&wal->mutex);
+    if (wal->file_length >= WAL_CHECKPOINT_BYTES) {
+        pager_checkpoint(pager);
+    }
+}
+
+/**
+ * Free pages
+ * Freed pages are chained into a list that starts in the meta page, each one
+ * holding the number of the next. New pages come from the head of the list
+ * and the file only grows once it is empty.
+ **/
+uint32_t get_unused_page_num(Pager* pager) {
+    // A bulk load writes its pages around the log, which is only safe for
+    // pages past the end of the file
+    if (pager->skip_wal) {
+        return pager->num_pages;
+    }
+    void* meta = get_page(pager, META_PAGE_NUM);
+    uint32_t page_num = *meta_freelist_head(meta);
+    if (page_num == 0) {
+        unpin_page(pager, META_PAGE_NUM);
+        return pager->num_pages;
+    }
+
+    void* page = get_page(pager, page_num);
+    mark_page_dirty(pager, META_PAGE_NUM);
+    *meta_freelist_head(meta) = *free_page_next(page);
+    *meta_free_pages(meta) -= 1;
+    unpin_page(pager, page_num);
+    unpin_page(pager, META_PAGE_NUM);
+    return page_num;
+}
+
+void free_page(Pager* pager, uint32_t page_num) {
+    void* page = get_page(pager, page_num);
+    void* meta = get_page(pager, META_PAGE_NUM);
+    mark_page_dirty(pager, page_num);
+    mark_page_dirty(pager, META_PAGE_NUM);
+
+    memset(page, 0, PAGE_SIZE);
+    *(uint8_t*)(page + FREE_PAGE_MARKER_OFFSET) = FREE_PAGE_MARKER;
+    *free_page_next(page) = *meta_freelist_head(meta);
+    *meta_freelist_head(meta) = page_num;
+    *meta_free_pages(meta) += 1;
+
+    unpin_page(pager, META_PAGE_NUM);
+    unpin_page(pager, page_num);
+}
+
+/**
+ * Drop every page from first_page_num on from the file. The log must be
+ * checkpointed and no page past the new end may be pinned.
+ **/
+void pager_truncate(Pager* pager, uint32_t first_page_num) {
+    if (pager->use_mmap) {
+        pager_mmap_flush_dirty(pager);
+        pager->map_pages = first_page_num;
+    } else {
+        pager_flush_dirty(pager);
+        pthread_mutex_lock(&pager->mutex);
+        for (uint32_t i = 0; i < pager->num_frames; i++) {
+            Frame* frame = &pager->frames[i];
+            if (frame->page_num != INVALID_PAGE_NUM && frame->page_num >= first_page_num) {
+                page_table_remove(pager, frame->page_num);
+                frame->page_num = INVALID_PAGE_NUM;
+            }
+        }
+        pthread_mutex_unlock(&pager->mutex);
+    }
+    pager->num_pages = first_page_num;
+    pager->file_length = (uint64_t)first_page_num * PAGE_SIZE;
+    if (ftruncate(pager->file_descriptor, (off_t)first_page_num * PAGE_SIZE) == -1 ||
+        fsync(pager->file_descriptor) == -1) {
+        printf("Error truncating db file: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * Statement arena
+ * Memory a statement needs only while it runs, as its cursors, comes from a
+ * bump allocator of the running thread instead of malloc. arena_free gives an
+ * allocation back at once when it is the latest one, which covers a cursor
+ * closed before the next one opens, and the blocks are freed all at once when
+ * the statement ends (see table_end_read).
+ **/
+typedef struct ArenaBlock_t {
+    struct ArenaBlock_t* next;  // the block filled before this one
+    uint32_t used;
+    uint32_t size;
+} ArenaBlock;
+
+// Block headers are padded to the alignment the allocations keep
+const uint32_t ARENA_ALIGNMENT = 16;
+const uint32_t ARENA_HEADER_SIZE = (sizeof(ArenaBlock) + 15) & ~15;
+
+static __thread ArenaBlock* thread_arena = NULL;
+
+uint32_t arena_rounded(uint32_t size) {
+    return (size + ARENA_ALIGNMENT - 1) & ~(ARENA_ALIGNMENT - 1);
+}
+
+void* arena_alloc(uint32_t size) {
+    size = arena_rounded(size);
+    ArenaBlock* block = thread_arena;
+    if (block == NULL || block->used + size > block->size) {
+        uint32_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        block = (ArenaBlock*) malloc(ARENA_HEADER_SIZE + block_size);
+        block->next = thread_arena;
+        block->used = 0;
+        block->size = block_size;
+        thread_arena = block;
+    }
+    void* pointer = (char*)block + ARENA_HEADER_SIZE + block->used;
+    block->used += size;
+    return pointer;
+}
+
+void arena_free(void* pointer, uint32_t size) {
+    ArenaBlock* block = thread_arena;
+    size = arena_rounded(size);
+    if (block != NULL && (char*)pointer + size == (char*)block + ARENA_HEADER_SIZE + block->used) {
+        block->used -= size;
+    }
+}
+
+void arena_reset() {
+    while (thread_arena != NULL) {
+        ArenaBlock* next = thread_arena->next;
+        free(thread_arena);
+        thread_arena = next;
+    }
+}
+
+/**
+ *  cursor methods
+ **/
+// A cursor on the given leaf, which it keeps pinned
+Cursor* leaf_node_find(Table* table, uint32_t page_num, void* node, uint32_t key) {
+    Cursor* cursor = (Cursor*) arena_alloc(sizeof(Cursor));
+    cursor->table = table;
+    cursor->page_num = page_num;
+    cursor->node = node;
+    cursor->end_of_table = false;
+    cursor->end_key = UINT32_MAX;
+    cursor->sequential_leaves = 0;
+    cursor->readahead_remaining = 0;
+    cursor->cell_num = leaf_node_lower_bound(node, key);
+    return cursor;
+}
+
+void cursor_close(Cursor* cursor) {
+    if (cursor->node != NULL) {
+        unpin_page(cursor->table->pager, cursor->page_num);
+    }
+    arena_free(cursor, sizeof(Cursor));
+}
+
+/**
+ * Return the index of the child which should contain the given key:
+ * the first key >= key, or num_keys (the right child) if there is none.
+ **/
+uint32_t internal_node_find_child(void* node, uint64_t key) {
+    uint32_t num_keys = *internal_node_num_keys(node);
+
+    // Binary search. There is one more child than key.
+    uint32_t min_index = 0;
+    uint32_t max_index = num_keys;
+
+    while (min_index != max_index) {
+        uint32_t index = (min_index + max_index) / 2;
+        uint64_t key_to_right = internal_node_key(node, index);
+        if (key_to_right >= key) {
+            max_index = index;
+        } else {
+            min_index = index + 1;
+        }
+    }
+    return min_index;
+}
+
+/**
+ * Descend from the root to the leaf that should contain the key. The leaf is
+ * returned pinned, its page number in leaf_page_num. When upper_bound is given
+ * it receives the largest key the leaf may hold (UINT64_MAX for the rightmost one).
+ **/
+void* btree_find_leaf(Table* tree, uint64_t key, uint32_t* leaf_page_num, uint64_t* upper_bound) {
+    Pager* pager = tree->pager;
+    uint32_t page_num = tree->root_page_num;
+    void* node = get_page(pager, page_num);
+    uint64_t bound = UINT64_MAX;
+    while (get_node_type(node) == NODE_INTERNAL) {
+        uint32_t child_index = internal_node_find_child(node, key);
+        uint32_t child_num = *internal_node_child(node, child_index);
+        if (child_index < *internal_node_num_keys(node)) {
+            // Keys only shrink on the way down, the last one seen is the tightest
+            bound = internal_node_key(node, child_index);
+        }
+        unpin_page(pager, page_num);
+        page_num = child_num;
+        node = get_page(pager, page_num);
+    }
+    *leaf_page_num = page_num;
+    if (upper_bound != NULL) {
+        *upper_bound = bound;
+    }
+    return node;
+}
+
+/**
+ * Record the internal nodes passed on the way from the root to the leaf
+ * that holds key. path[0] is the root. Returns the number of internal nodes.
+ * When leaf_page_num is given it receives the page number of that leaf.
+ **/
+uint32_t table_find_path(Table* table, uint64_t key, uint32_t* path, uint32_t* leaf_page_num) {
+    uint32_t depth = 0;
+    uint32_t page_num = table->root_page_num;
+    while (true) {
+        void* node = get_page(table->pager, page_num);
+        if (get_node_type(node) == NODE_LEAF) {
+            unpin_page(table->pager, page_num);
+            if (leaf_page_num != NULL) {
+                *leaf_page_num = page_num;
+            }
+            return depth;
+        }
+        if (depth == BTREE_MAX_HEIGHT) {
+            printf("Tree is deeper than %d levels.\n", BTREE_MAX_HEIGHT);
+            exit(EXIT_FAILURE);
+        }
+        path[depth++] = page_num;
+        uint32_t child_num = *internal_node_child(node, internal_node_find_child(node, key));
+        unpin_page(table->pager, page_num);
+        page_num = child_num;
+    }
+}
+
+/**
+ * Return the position of the given key.
+ * If the key is not present, return the position where it should be inserted.
+ * When upper_bound is given it receives the largest key the returned leaf
+ * may hold (UINT32_MAX for the rightmost leaf).
+ **/
+Cursor* table_find_bounded(Table* table, uint32_t key, uint32_t* upper_bound) {
+    uint32_t page_num;
+    uint64_t bound;
+    void* node = btree_find_leaf(table, key, &page_num, &bound);
+    if (upper_bound != NULL) {
+        *upper_bound = bound < UINT32_MAX ? (uint32_t)bound : UINT32_MAX;
+    }
+    return leaf_node_find(table, page_num, node, key);
+}
+
+Cursor* table_find(Table* table, uint32_t key) {
+    return table_find_bounded(table, key, NULL);
+}
+
+void cursor_settle(Cursor* cursor);
+
+/**
+ * A cursor over the keys in [start_key, end_key]: it starts at the first of
+ * them and cursor_advance stops after the last, so only the leaves holding
+ * the range are read.
+ **/
+Cursor* table_seek(Table* table, uint32_t start_key, uint32_t end_key) {
+    Cursor* cursor = table_find(table, start_key);
+    cursor->end_key = end_key;
+    cursor_settle(cursor);
     return cursor;
 }
 
-Cursor* leaf_node_find(Table* table, uint32_t page_num, uint32_t key) {
+/**
+ * Start at the leftmost leaf: no key is smaller than 0.
+ **/
+Cursor* table_start(Table* table) {
+    return table_seek(table, 0, UINT32_MAX);
+}
+
+uint32_t cursor_key(Cursor* cursor) {
+    return *leaf_node_key(cursor->node, cursor->cell_num);
+}
+
+/**
+ * The returned value lives in the cursor's leaf.
+ * It stays valid until the cursor moves on or is closed.
+ **/
+void* cursor_value(Cursor* cursor) {
+    return leaf_node_value(cursor->node, cursor->cell_num);
+}
+
+/**
+ * The row under the cursor, read in place.
+ * It stays valid until the cursor moves on or is closed.
+ **/
+void cursor_view(Cursor* cursor, RowView* view) {
+    row_view(cursor_key(cursor), cursor_value(cursor), view);
+}
+
+/**
+ * The cursor just stepped onto a leaf through a sibling link.
+ * Once it has done so READAHEAD_TRIGGER times in a row it is scanning, and the
+ * next leaves are prefetched. Their page numbers come from the parent, which
+ * lists the leaves in key order even when they are scattered over the file.
+ **/
+void cursor_readahead(Cursor* cursor) {
+    Pager* pager = cursor->table->pager;
+    cursor->sequential_leaves += 1;
+    if (cursor->readahead_remaining > 0) {
+        cursor->readahead_remaining -= 1;
+        return;
+    }
+    if (pager->readahead_pages == 0 || cursor->sequential_leaves < READAHEAD_TRIGGER) {
+        return;
+    }
+
+    uint32_t key = *leaf_node_key(cursor->node, 0);
+    uint32_t parent_page_num = cursor->table->root_page_num;
+    void* parent = get_page(pager, parent_page_num);
+    while (true) {
+        if (get_node_type(parent) != NODE_INTERNAL) {
+            unpin_page(pager, parent_page_num);
+            return;
+        }
+        uint32_t child_num = *internal_node_child(parent, internal_node_find_child(parent, key));
+        if (child_num == cursor->page_num) {
+            break;
+        }
+        unpin_page(pager, parent_page_num);
+        parent_page_num = child_num;
+        parent = get_page(pager, parent_page_num);
+    }
+    uint32_t num_keys = *internal_node_num_keys(parent);
+    uint32_t child_index = internal_node_find_child(parent, key);
+
+    uint32_t* page_nums = (uint32_t*) arena_alloc(sizeof(uint32_t) * pager->readahead_pages);
+    uint32_t count = 0;
+    // Leaves past the end of a range scan are left alone
+    for (uint32_t i = child_index + 1; i <= num_keys && count < pager->readahead_pages &&
+                                       internal_node_key(parent, i - 1) < cursor->end_key; i++) {
+        page_nums[count++] = *internal_node_child(parent, i);
+    }
+    unpin_page(pager, parent_page_num);
+
+    pager_prefetch(pager, page_nums, count);
+    arena_free(page_nums, sizeof(uint32_t) * pager->readahead_pages);
+    cursor->readahead_remaining = count;
+}
+
+/**
+ * Past the last key of its leaf the cursor moves on to the next leaf holding a
+ * key, or to the end of its range.
+ **/
+void cursor_settle(Cursor* cursor) {
+    Pager* pager = cursor->table->pager;
+    while (true) {
+        void* node = cursor->node;
+        uint32_t num_cells = *leaf_node_num_cells(node);
+        if (cursor->cell_num < num_cells) {
+            cursor->end_of_table = *leaf_node_key(node, cursor->cell_num) > cursor->end_key;
+            return;
+        }
+
+        // Follow the sibling link instead of descending from the root again
+        uint32_t next_page_num = *leaf_node_next_leaf(node);
+        if (num_cells == 0 || next_page_num == 0 ||
+            *leaf_node_key(node, num_cells - 1) >= cursor->end_key) {
+            cursor->end_of_table = true;
+            return;
+        }
+        unpin_page(pager, cursor->page_num);
+        cursor->page_num = next_page_num;
+        cursor->cell_num = 0;
+        cursor->node = get_page(pager, next_page_num);
+        cursor_readahead(cursor);
+    }
+}
+
+void cursor_advance(Cursor* cursor) {
+    cursor->cell_num += 1;
+    cursor_settle(cursor);
+}
+
+
+//Let N be the root node. First allocate two nodes, 
+//say L and R. Move lower half of N into L and the upper half into R. 
+//Now N is empty. Add 〈L, K,R〉 in N, where K is the max key in L.
+// Page N remains the root. Note that the depth of the tree has increased by one, 
+//but the new tree remains height balanced without violating any B+-tree property.
+
+void create_new_root(Table* table, uint64_t left_child_max_key, uint32_t right_child_page_num) {
+  /*
+   Handle splitting the root.
+   Old root copied to new page, becomes left child.
+   Address of right child and the max key of the left child passed in.
+   Re-initialize root page to contain the new root node.
+   New root node points to two children.
+   */
+    stats_add(&table->pager->stats.root_splits, 1);
+    void* root        = get_page(table->pager, table->root_page_num);
+    uint32_t left_child_page_num = get_unused_page_num(table->pager);
+
+    void* left_child  = get_page(table->pager, left_child_page_num);
+    mark_page_dirty(table->pager, table->root_page_num);
+    mark_page_dirty(table->pager, left_child_page_num);
+
+    // Left child has data copied from old root
+    memcpy(left_child, root, PAGE_SIZE);
+    set_node_root(left_child, false);
+
+
+    // Initialize the root page as a new internal node with two children
+    initialize_internal_node(root);
+    set_node_root(root, true);
+
+    uint64_t keys[1] = { left_child_max_key };
+    uint32_t children[2] = { left_child_page_num, right_child_page_num };
+    internal_node_set_cells(root, keys, children, 1);
+
+    unpin_page(table->pager, left_child_page_num);
+    unpin_page(table->pager, table->root_page_num);
+}
+
+void internal_node_insert(Table* table, uint32_t* path, uint32_t depth,
+                          uint64_t split_key, uint32_t new_child_page_num);
+
+// Whether keys[from, to) can share one internal node
+bool internal_node_keys_fit(uint64_t* keys, uint32_t from, uint32_t to) {
+    return to - from <= internal_node_capacity(internal_node_width_for(keys[to - 1] - keys[from]));
+}
+
+/**
+ * Where to cut total_keys keys into two internal nodes: the left one keeps
+ * keys [0, middle), the right one gets (middle, total_keys) and keys[middle]
+ * goes up. A key far from the others can make one half need wider deltas,
+ * then the middle moves away from it until both fit.
+ **/
+uint32_t internal_node_split_point(uint64_t* keys, uint32_t total_keys) {
+    uint32_t middle = total_keys / 2;
+    while (middle > 1 && !internal_node_keys_fit(keys, 0, middle)) {
+        middle--;
+    }
+    while (middle + 2 < total_keys && !internal_node_keys_fit(keys, middle + 1, total_keys)) {
+        middle++;
+    }
+    return middle;
+}
+
+/**
+ * The internal node path[depth - 1] is full. Split it around its middle key,
+ * moving the upper half of the children into a new node, and push the middle
+ * key up into the parent (or a new root).
+ **/
+void internal_node_split_and_insert(Table* table, uint32_t* path, uint32_t depth,
+                                    uint64_t split_key, uint32_t new_child_page_num) {
+    Pager* pager = table->pager;
+    stats_add(&pager->stats.internal_splits, 1);
+    uint32_t old_page_num = path[depth - 1];
+    void* old_node = get_page(pager, old_page_num);
+    mark_page_dirty(pager, old_page_num);
+
+    // Lay out all keys and children in order, including the new ones
+    uint32_t num_keys = *internal_node_num_keys(old_node);
+    uint32_t index = internal_node_find_child(old_node, split_key);
+    uint64_t* keys = (uint64_t*) arena_alloc(sizeof(uint64_t) * (num_keys + 1));
+    uint32_t* children = (uint32_t*) arena_alloc(sizeof(uint32_t) * (num_keys + 2));
+    for (uint32_t i = 0, k = 0; i < num_keys; i++) {
+        if (i == index) {
+            keys[k++] = split_key;
+        }
+        keys[k++] = internal_node_key(old_node, i);
+    }
+    if (index == num_keys) {
+        keys[num_keys] = split_key;
+    }
+    for (uint32_t i = 0, c = 0; i <= num_keys; i++) {
+        children[c++] = *internal_node_child(old_node, i);
+        if (i == index) {
+            children[c++] = new_child_page_num;
+        }
+    }
+
+    uint32_t new_page_num = get_unused_page_num(pager);
+    void* new_node = get_page(pager, new_page_num);
+    mark_page_dirty(pager, new_page_num);
+    initialize_internal_node(new_node);
+
+    // Left's right child is the child below the middle key
+    uint32_t total_keys = num_keys + 1;
+    uint32_t middle = internal_node_split_point(keys, total_keys);
+    internal_node_set_cells(old_node, keys, children, middle);
+    internal_node_set_cells(new_node, keys + middle + 1, children + middle + 1, total_keys - middle - 1);
+
+    uint64_t middle_key = keys[middle];
+    bool splitting_root = is_node_root(old_node);
+    arena_free(children, sizeof(uint32_t) * (num_keys + 2));
+    arena_free(keys, sizeof(uint64_t) * (num_keys + 1));
+    unpin_page(pager, new_page_num);
+    unpin_page(pager, old_page_num);
+
+    if (splitting_root) {
+        create_new_root(table, middle_key, new_page_num);
+    } else {
+        internal_node_insert(table, path, depth - 1, middle_key, new_page_num);
+    }
+}
+
+/**
+ * A child of path[depth - 1] split in two: the old child keeps the keys up to
+ * split_key and new_child_page_num holds the rest. Add the new child right
+ * after the old one, splitting the internal node too if it is full.
+ **/
+void internal_node_insert(Table* table, uint32_t* path, uint32_t depth,
+                          uint64_t split_key, uint32_t new_child_page_num) {
+    Pager* pager = table->pager;
+    uint32_t parent_page_num = path[depth - 1];
+    void* parent = get_page(pager, parent_page_num);
+
+    if (!internal_node_has_room(parent, split_key)) {
+        unpin_page(pager, parent_page_num);
+        internal_node_split_and_insert(table, path, depth, split_key, new_child_page_num);
+        return;
+    }
+
+    mark_page_dirty(pager, parent_page_num);
+    // The old child is the first one whose max key is >= split_key. Its cell now
+    // ends at split_key, and the new child takes over the old max key (or the right child slot).
+    uint32_t index = internal_node_find_child(parent, split_key);
+    internal_node_insert_cell(parent, index, split_key, new_child_page_num);
+    unpin_page(pager, parent_page_num);
+}
+
+// path and depth are the internal nodes above the cursor's leaf, from table_find_path
+void leaf_node_split_and_insert(Cursor* cursor, uint32_t key, Row* value, uint32_t* path, uint32_t depth) {
+    /*
+    Create a new node and move half the cells over.
+    Insert the new value in one of the two nodes.
+    Update parent or create a new parent.
+    */
+    Pager* pager = cursor->table->pager;
+    stats_add(&pager->stats.leaf_splits, 1);
+
+    void* old_node = get_page(pager, cursor->page_num);
+
+    uint32_t new_page_num = get_unused_page_num(pager);
+    void* new_node = get_page(pager, new_page_num);
+    mark_page_dirty(pager, cursor->page_num);
+    mark_page_dirty(pager, new_page_num);
+
+    initialize_leaf_node(new_node);
+    *leaf_node_next_leaf(new_node) = *leaf_node_next_leaf(old_node);
+
+    /**
+     * All existing cells plus the new one are divided between the old (left)
+     * and new (right) nodes so that both hold about the same number of bytes.
+     * The old node is rebuilt from a copy, one cell after the other.
+     **/
+    char* old_copy = (char*) arena_alloc(PAGE_SIZE);
+    memcpy(old_copy, old_node, PAGE_SIZE);
+    uint32_t num_cells = *leaf_node_num_cells(old_copy);
+    uint32_t value_size = row_value_size(value);
+
+    uint32_t total_bytes = LEAF_NODE_KEY_SIZE + value_size + LEAF_NODE_SLOT_SIZE;
+    for (uint32_t i = 0; i < num_cells; i++) {
+        total_bytes += leaf_node_cell_size(old_copy, i) + LEAF_NODE_SLOT_SIZE;
+    }
+
+    bool is_root = is_node_root(old_copy);
+    initialize_leaf_node(old_node);
+    set_node_root(old_node, is_root);
+    *leaf_node_next_leaf(old_node) = new_page_num;
+
+    void* destination_node = old_node;
+    uint32_t left_bytes = 0;
+    for (uint32_t i = 0; i <= num_cells; i++) {
+        bool is_new = i == cursor->cell_num;
+        uint32_t source_index = i < cursor->cell_num ? i : i - 1;
+        uint32_t cell_size = is_new ? LEAF_NODE_KEY_SIZE + value_size
+                                    : leaf_node_cell_size(old_copy, source_index);
+
+        if (destination_node == old_node && i > 0 &&
+            left_bytes + cell_size + LEAF_NODE_SLOT_SIZE > total_bytes / 2) {
+            destination_node = new_node;
+        }
+        if (destination_node == old_node) {
+            left_bytes += cell_size + LEAF_NODE_SLOT_SIZE;
+        }
+
+        uint32_t index_within_node = *leaf_node_num_cells(destination_node);
+        if (is_new) {
+            serialize_row(value, leaf_node_insert_cell(destination_node, index_within_node,
+                                                       key, value_size));
+        } else {
+            void* destination = leaf_node_insert_cell(destination_node, index_within_node,
+                                                      *leaf_node_key(old_copy, source_index),
+                                                      cell_size - LEAF_NODE_KEY_SIZE);
+            memcpy(destination, leaf_node_value(old_copy, source_index),
+                   cell_size - LEAF_NODE_KEY_SIZE);
+        }
+    }
+
+    arena_free(old_copy, PAGE_SIZE);
+
+    uint64_t split_key = get_node_max_key(old_node);
+    bool splitting_root = is_root;
+    unpin_page(pager, new_page_num);
+    unpin_page(pager, cursor->page_num);
+
+    if (splitting_root) {
+        create_new_root(cursor->table, split_key, new_page_num);
+    } else {
+        internal_node_insert(cursor->table, path, depth, split_key, new_page_num);
+    }
+}
+
+void leaf_node_insert(Cursor* cursor, uint32_t key, Row* value, uint32_t* path, uint32_t depth) {
+    void* node = get_page(cursor->table->pager, cursor->page_num);
+
+    uint32_t value_size = row_value_size(value);
+
+    if (!leaf_node_has_room(node, LEAF_NODE_KEY_SIZE + value_size)) {
+        // Node full
+        unpin_page(cursor->table->pager, cursor->page_num);
+        leaf_node_split_and_insert(cursor, key, value, path, depth);
+        return;
+    }
+
+    mark_page_dirty(cursor->table->pager, cursor->page_num);
+    serialize_row(value, leaf_node_insert_cell(node, cursor->cell_num, key, value_size));
+    unpin_page(cursor->table->pager, cursor->page_num);
+}
+
+/**
+ * Insert a run of rows, sorted by id and free of duplicates, into one leaf that
+ * has room for all of them. The new values are written into the free space in
+ * one go, then the keys and slots are merged with the new ones in a single
+ * pass, however many rows are added.
+ **/
+void leaf_node_insert_sorted(Table* table, uint32_t page_num, Row* rows, uint32_t count) {
+    void* node = get_page(table->pager, page_num);
+    mark_page_dirty(table->pager, page_num);
+
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    uint32_t values_size = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        values_size += row_value_size(&rows[i]);
+    }
+    if (*leaf_node_content_start(node) < leaf_node_slots_end(num_cells + count) + values_size) {
+        leaf_node_compact(node);
+    }
+
+    // Both arrays grow and the slots move behind the longer key array, so the
+    // old keys and slots are merged from a copy.
+    char* copy = (char*) arena_alloc(leaf_node_slots_end(num_cells));
+    memcpy(copy, node, leaf_node_slots_end(num_cells));
+
+    uint32_t offset = *leaf_node_content_start(node);
+    *leaf_node_num_cells(node) = num_cells + count;
+    uint32_t old_index = 0;
+    uint32_t new_index = 0;
+    for (uint32_t write_index = 0; write_index < num_cells + count; write_index++) {
+        if (new_index == count ||
+            (old_index < num_cells && *leaf_node_key(copy, old_index) < rows[new_index].id)) {
+            *leaf_node_key(node, write_index) = *leaf_node_key(copy, old_index);
+            *leaf_node_slot(node, write_index) = *leaf_node_slot(copy, old_index);
+            old_index++;
+        } else {
+            offset -= row_value_size(&rows[new_index]);
+            serialize_row(&rows[new_index], node + offset);
+            *leaf_node_key(node, write_index) = rows[new_index].id;
+            *leaf_node_slot(node, write_index) = offset;
+            new_index++;
+        }
+    }
+    *leaf_node_content_start(node) = offset;
+    arena_free(copy, leaf_node_slots_end(num_cells));
+    unpin_page(table->pager, page_num);
+}
+
+/**
+ * Secondary indexes
+ * An index on a string column is a B+tree of 64-bit entries: the column's hash
+ * in the high half and the row id in the low half, so entries are unique and
+ * the rows sharing a hash are next to each other. Its internal nodes are the
+ * table's own, reached through a Table that has the index root as its root.
+ * A lookup scans the entries for the hash and compares the strings of the rows
+ * they point to, which also weeds out hash collisions.
+ **/
+uint32_t hash_string(const char* string, uint32_t length) {
+    uint32_t hash = 2166136261u;  // FNV-1a
+    for (uint32_t i = 0; i < length; i++) {
+        hash = (hash ^ (uint8_t)string[i]) * 16777619u;
+    }
+    return hash;
+}
+
+char* row_column(Row* row, Column column) {
+    return column == COLUMN_USERNAME ? row->username : row->email;
+}
+
+uint64_t index_entry(uint32_t id, const char* value, uint32_t length) {
+    return ((uint64_t)hash_string(value, length) << 32) | id;
+}
+
+Index* table_index(Table* table, Column column) {
+    for (uint32_t i = 0; i < table->num_indexes; i++) {
+        if (table->indexes[i].column == column) {
+            return &table->indexes[i];
+        }
+    }
+    return NULL;
+}
+
+Table index_tree(Table* table, Index* index) {
+    Table tree;
+    tree.root_page_num = index->root_page_num;
+    tree.pager = table->pager;
+    tree.num_indexes = 0;
+    return tree;
+}
+
+/**
+ * A full leaf splits in half, except when the entry goes after all others, as
+ * in index_build: then the old leaf stays full and the entry starts a new one.
+ **/
+void index_insert(Table* table, Index* index, uint64_t entry) {
+    Pager* pager = table->pager;
+    Table tree = index_tree(table, index);
+    uint32_t path[BTREE_MAX_HEIGHT];
+    uint32_t page_num;
+    uint32_t depth = table_find_path(&tree, entry, path, &page_num);
+
+    void* leaf = get_page(pager, page_num);
+    mark_page_dirty(pager, page_num);
+    uint32_t num_entries = *leaf_node_num_cells(leaf);
+    uint32_t position = index_leaf_lower_bound(leaf, entry);
+
+    if (num_entries < INDEX_LEAF_MAX_ENTRIES) {
+        memmove(index_leaf_entry(leaf, position + 1), index_leaf_entry(leaf, position),
+                (num_entries - position) * INDEX_ENTRY_SIZE);
+        *index_leaf_entry(leaf, position) = entry;
+        *leaf_node_num_cells(leaf) = num_entries + 1;
+        unpin_page(pager, page_num);
+        return;
+    }
+
+    stats_add(&pager->stats.leaf_splits, 1);
+    uint32_t new_page_num = get_unused_page_num(pager);
+    void* new_leaf = get_page(pager, new_page_num);
+    mark_page_dirty(pager, new_page_num);
+    initialize_index_leaf(new_leaf);
+    *leaf_node_next_leaf(new_leaf) = *leaf_node_next_leaf(leaf);
+    *leaf_node_next_leaf(leaf) = new_page_num;
+
+    uint64_t* entries = (uint64_t*) arena_alloc(INDEX_ENTRY_SIZE * (num_entries + 1));
+    memcpy(entries, index_leaf_entry(leaf, 0), position * INDEX_ENTRY_SIZE);
+    entries[position] = entry;
+    memcpy(entries + position + 1, index_leaf_entry(leaf, position),
+           (num_entries - position) * INDEX_ENTRY_SIZE);
+
+    uint32_t total = num_entries + 1;
+    uint32_t left_count = position == num_entries ? num_entries : total / 2;
+    memcpy(index_leaf_entry(leaf, 0), entries, left_count * INDEX_ENTRY_SIZE);
+    memcpy(index_leaf_entry(new_leaf, 0), entries + left_count, (total - left_count) * INDEX_ENTRY_SIZE);
+    *leaf_node_num_cells(leaf) = left_count;
+    *leaf_node_num_cells(new_leaf) = total - left_count;
+
+    uint64_t split_key = entries[left_count - 1];
+    arena_free(entries, INDEX_ENTRY_SIZE * (num_entries + 1));
+    bool splitting_root = is_node_root(leaf);
+    unpin_page(pager, new_page_num);
+    unpin_page(pager, page_num);
+
+    if (splitting_root) {
+        create_new_root(&tree, split_key, new_page_num);
+    } else {
+        internal_node_insert(&tree, path, depth, split_key, new_page_num);
+    }
+}
+
+// Each entry may land in a different leaf, so a long batch can commit between rows
+void table_index_row(Table* table, Row* row) {
+    for (uint32_t i = 0; i < table->num_indexes; i++) {
+        char* value = row_column(row, table->indexes[i].column);
+        index_insert(table, &table->indexes[i], index_entry(row->id, value, strlen(value)));
+    }
+    if (pager_commit_due(table->pager)) {
+        pager_commit(table->pager);
+    }
+}
+
+int compare_uint64(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+/**
+ * Add every row of the table to an empty index. The entries are sorted first
+ * so each one is appended to the rightmost leaf.
+ **/
+void index_build(Table* table, Index* index) {
+    uint32_t num_entries = 0;
+    uint32_t capacity = 1024;
+    uint64_t* entries = (uint64_t*) malloc(sizeof(uint64_t) * capacity);
+
+    Cursor* cursor = table_start(table);
+    RowView row;
+    while (!(cursor->end_of_table)) {
+        cursor_view(cursor, &row);
+        if (num_entries == capacity) {
+            capacity *= 2;
+            entries = (uint64_t*) realloc(entries, sizeof(uint64_t) * capacity);
+        }
+        uint32_t length;
+        const char* value = row_view_column(&row, index->column, &length);
+        entries[num_entries++] = index_entry(row.id, value, length);
+        cursor_advance(cursor);
+    }
+    cursor_close(cursor);
+
+    qsort(entries, num_entries, sizeof(uint64_t), compare_uint64);
+    for (uint32_t i = 0; i < num_entries; i++) {
+        index_insert(table, index, entries[i]);
+        if (pager_commit_due(table->pager)) {
+            pager_commit(table->pager);
+        }
+    }
+    free(entries);
+}
+
+/**
+ * Delete
+ * A node that falls below a quarter full is evened out with a sibling under
+ * the same parent: the two are merged when they fit in one page, otherwise
+ * their contents are split evenly between them. Of a merged pair the left
+ * page stays, so the sibling link pointing to it from the left is still
+ * right, and the right page is freed. A merge takes a key out of the parent,
+ * which may leave that one underfull in turn, and a root left with a single
+ * child is replaced by it, so the tree gets shorter as it empties.
+ **/
+bool leaf_node_underfull(void* node) {
+    if (*node_format(node) == LEAF_FORMAT_INDEX) {
+        return *leaf_node_num_cells(node) < INDEX_LEAF_MAX_ENTRIES / 4;
+    }
+    return leaf_node_used_space(node) < LEAF_NODE_SPACE_FOR_CELLS / 4;
+}
+
+bool internal_node_underfull(void* node) {
+    return *internal_node_num_keys(node) < internal_node_capacity(*internal_node_key_width(node)) / 4;
+}
+
+// Append cell_num of source to the end of node, which has room for it
+void leaf_node_append_cell(void* node, void* source, uint32_t cell_num) {
+    uint32_t value_size = leaf_node_cell_size(source, cell_num) - LEAF_NODE_KEY_SIZE;
+    void* value = leaf_node_insert_cell(node, *leaf_node_num_cells(node),
+                                        *leaf_node_key(source, cell_num), value_size);
+    memcpy(value, leaf_node_value(source, cell_num), value_size);
+}
+
+/**
+ * Even out two neighbouring leaves of the table. Returns true when right was
+ * merged into left, otherwise *separator receives the new max key of left.
+ **/
+bool leaf_node_rebalance(void* left, void* right, uint64_t* separator) {
+    uint32_t left_cells = *leaf_node_num_cells(left);
+    uint32_t right_cells = *leaf_node_num_cells(right);
+    if (leaf_node_used_space(left) + leaf_node_used_space(right) <= LEAF_NODE_SPACE_FOR_CELLS) {
+        for (uint32_t i = 0; i < right_cells; i++) {
+            leaf_node_append_cell(left, right, i);
+        }
+        *leaf_node_next_leaf(left) = *leaf_node_next_leaf(right);
+        return true;
+    }
+
+    char* left_copy = (char*) arena_alloc(2 * PAGE_SIZE);
+    char* right_copy = left_copy + PAGE_SIZE;
+    memcpy(left_copy, left, PAGE_SIZE);
+    memcpy(right_copy, right, PAGE_SIZE);
+    uint32_t total_cells = left_cells + right_cells;
+
+    // Cut where the bytes of the cells before it first reach half of all of them
+    uint32_t total_bytes = 0;
+    for (uint32_t i = 0; i < total_cells; i++) {
+        void* node = i < left_cells ? (void*)left_copy : (void*)right_copy;
+        total_bytes += leaf_node_cell_size(node, i < left_cells ? i : i - left_cells);
+    }
+    uint32_t cut = 0;
+    for (uint32_t bytes = 0; cut + 1 < total_cells && bytes * 2 < total_bytes; cut++) {
+        void* node = cut < left_cells ? (void*)left_copy : (void*)right_copy;
+        bytes += leaf_node_cell_size(node, cut < left_cells ? cut : cut - left_cells);
+    }
+
+    uint32_t left_next = *leaf_node_next_leaf(left);
+    uint32_t right_next = *leaf_node_next_leaf(right);
+    initialize_leaf_node(left);
+    initialize_leaf_node(right);
+    *leaf_node_next_leaf(left) = left_next;
+    *leaf_node_next_leaf(right) = right_next;
+    for (uint32_t i = 0; i < total_cells; i++) {
+        void* node = i < left_cells ? (void*)left_copy : (void*)right_copy;
+        leaf_node_append_cell(i < cut ? left : right, node, i < left_cells ? i : i - left_cells);
+    }
+    arena_free(left_copy, 2 * PAGE_SIZE);
+    *separator = *leaf_node_key(left, cut - 1);
+    return false;
+}
+
+// Same for two leaves of an index
+bool index_leaf_rebalance(void* left, void* right, uint64_t* separator) {
+    uint32_t left_entries = *leaf_node_num_cells(left);
+    uint32_t right_entries = *leaf_node_num_cells(right);
+    uint32_t total = left_entries + right_entries;
+    if (total <= INDEX_LEAF_MAX_ENTRIES) {
+        memcpy(index_leaf_entry(left, left_entries), index_leaf_entry(right, 0),
+               right_entries * INDEX_ENTRY_SIZE);
+        *leaf_node_num_cells(left) = total;
+        *leaf_node_next_leaf(left) = *leaf_node_next_leaf(right);
+        return true;
+    }
+
+    uint32_t left_count = total / 2;
+    if (left_count > left_entries) {
+        uint32_t moved = left_count - left_entries;
+        memcpy(index_leaf_entry(left, left_entries), index_leaf_entry(right, 0), moved * INDEX_ENTRY_SIZE);
+        memmove(index_leaf_entry(right, 0), index_leaf_entry(right, moved),
+                (right_entries - moved) * INDEX_ENTRY_SIZE);
+    } else {
+        uint32_t moved = left_entries - left_count;
+        memmove(index_leaf_entry(right, moved), index_leaf_entry(right, 0), right_entries * INDEX_ENTRY_SIZE);
+        memcpy(index_leaf_entry(right, 0), index_leaf_entry(left, left_count), moved * INDEX_ENTRY_SIZE);
+    }
+    *leaf_node_num_cells(left) = left_count;
+    *leaf_node_num_cells(right) = total - left_count;
+    *separator = *index_leaf_entry(left, left_count - 1);
+    return false;
+}
+
+/**
+ * Same for two internal nodes. The parent key between them, passed in
+ * *separator, comes down to sit between their keys.
+ **/
+bool internal_node_rebalance(void* left, void* right, uint64_t* separator) {
+    uint32_t left_keys = *internal_node_num_keys(left);
+    uint32_t right_keys = *internal_node_num_keys(right);
+    uint32_t total_keys = left_keys + 1 + right_keys;
+    uint64_t* keys = (uint64_t*) arena_alloc(sizeof(uint64_t) * total_keys);
+    uint32_t* children = (uint32_t*) arena_alloc(sizeof(uint32_t) * (total_keys + 1));
+    internal_node_get_cells(left, keys, children);
+    keys[left_keys] = *separator;
+    internal_node_get_cells(right, keys + left_keys + 1, children + left_keys + 1);
+
+    bool merged = internal_node_keys_fit(keys, 0, total_keys);
+    if (merged) {
+        internal_node_set_cells(left, keys, children, total_keys);
+    } else {
+        uint32_t middle = internal_node_split_point(keys, total_keys);
+        internal_node_set_cells(left, keys, children, middle);
+        internal_node_set_cells(right, keys + middle + 1, children + middle + 1, total_keys - middle - 1);
+        *separator = keys[middle];
+    }
+    arena_free(children, sizeof(uint32_t) * (total_keys + 1));
+    arena_free(keys, sizeof(uint64_t) * total_keys);
+    return merged;
+}
+
+/**
+ * While the root is an internal node with a single child, move that child
+ * into the root page. The root keeps its page number.
+ **/
+void btree_collapse_root(Table* tree) {
+    Pager* pager = tree->pager;
+    while (true) {
+        void* root = get_page(pager, tree->root_page_num);
+        if (get_node_type(root) != NODE_INTERNAL || *internal_node_num_keys(root) > 0) {
+            unpin_page(pager, tree->root_page_num);
+            return;
+        }
+        uint32_t child_page_num = *internal_node_right_child(root);
+        void* child = get_page(pager, child_page_num);
+        mark_page_dirty(pager, tree->root_page_num);
+        memcpy(root, child, PAGE_SIZE);
+        set_node_root(root, true);
+        unpin_page(pager, child_page_num);
+        unpin_page(pager, tree->root_page_num);
+        free_page(pager, child_page_num);
+    }
+}
+
+/**
+ * The child of path[depth - 1] on the way to key is underfull: even it out
+ * with a sibling and carry on upwards while merges leave parents underfull.
+ **/
+void btree_rebalance(Table* tree, uint32_t* path, uint32_t depth, uint64_t key) {
+    Pager* pager = tree->pager;
+    while (depth > 0) {
+        uint32_t parent_page_num = path[depth - 1];
+        void* parent = get_page(pager, parent_page_num);
+        uint32_t num_keys = *internal_node_num_keys(parent);
+        if (num_keys == 0) {
+            unpin_page(pager, parent_page_num);
+            return;
+        }
+        uint32_t index = internal_node_find_child(parent, key);
+        uint32_t left_index = index < num_keys ? index : index - 1;
+        uint32_t cells_size = sizeof(uint64_t) * num_keys + sizeof(uint32_t) * (num_keys + 1);
+        uint64_t* keys = (uint64_t*) arena_alloc(cells_size);
+        uint32_t* children = (uint32_t*) (keys + num_keys);
+        internal_node_get_cells(parent, keys, children);
+
+        uint32_t left_page_num = children[left_index];
+        uint32_t right_page_num = children[left_index + 1];
+        void* left = get_page(pager, left_page_num);
+        void* right = get_page(pager, right_page_num);
+        mark_page_dirty(pager, parent_page_num);
+        mark_page_dirty(pager, left_page_num);
+        mark_page_dirty(pager, right_page_num);
+
+        uint64_t separator = keys[left_index];
+        bool merged;
+        if (get_node_type(left) == NODE_INTERNAL) {
+            merged = internal_node_rebalance(left, right, &separator);
+        } else if (*node_format(left) == LEAF_FORMAT_INDEX) {
+            merged = index_leaf_rebalance(left, right, &separator);
+        } else {
+            merged = leaf_node_rebalance(left, right, &separator);
+        }
+        unpin_page(pager, right_page_num);
+        unpin_page(pager, left_page_num);
+
+        if (merged) {
+            stats_add(&pager->stats.merges, 1);
+            // Left now reaches up to where right did
+            memmove(keys + left_index, keys + left_index + 1, (num_keys - left_index - 1) * sizeof(uint64_t));
+            memmove(children + left_index + 1, children + left_index + 2,
+                    (num_keys - left_index - 1) * sizeof(uint32_t));
+            num_keys--;
+            free_page(pager, right_page_num);
+        } else {
+            keys[left_index] = separator;
+        }
+        internal_node_set_cells(parent, keys, children, num_keys);
+        bool parent_is_root = is_node_root(parent);
+        bool parent_underfull = internal_node_underfull(parent);
+        unpin_page(pager, parent_page_num);
+        arena_free(keys, cells_size);
+
+        if (parent_is_root) {
+            btree_collapse_root(tree);
+            return;
+        }
+        if (!merged || !parent_underfull) {
+            return;
+        }
+        depth--;
+    }
+}
+
+// Remove one entry from an index, if it is there
+void index_delete(Table* table, Index* index, uint64_t entry) {
+    Pager* pager = table->pager;
+    Table tree = index_tree(table, index);
+    uint32_t path[BTREE_MAX_HEIGHT];
+    uint32_t page_num;
+    uint32_t depth = table_find_path(&tree, entry, path, &page_num);
+
+    void* leaf = get_page(pager, page_num);
+    uint32_t num_entries = *leaf_node_num_cells(leaf);
+    uint32_t position = index_leaf_lower_bound(leaf, entry);
+    if (position == num_entries || *index_leaf_entry(leaf, position) != entry) {
+        unpin_page(pager, page_num);
+        return;
+    }
+    mark_page_dirty(pager, page_num);
+    memmove(index_leaf_entry(leaf, position), index_leaf_entry(leaf, position + 1),
+            (num_entries - position - 1) * INDEX_ENTRY_SIZE);
+    *leaf_node_num_cells(leaf) = num_entries - 1;
+    bool underfull = !is_node_root(leaf) && leaf_node_underfull(leaf);
+    unpin_page(pager, page_num);
+
+    if (underfull) {
+        btree_rebalance(&tree, path, depth, entry);
+    }
+}
+
+/**
+ * Remove the row with the given key and its index entries.
+ * Returns false when there is no such row.
+ **/
+bool table_delete(Table* table, uint32_t key) {
+    Pager* pager = table->pager;
+    uint32_t path[BTREE_MAX_HEIGHT];
+    uint32_t page_num;
+    uint32_t depth = table_find_path(table, key, path, &page_num);
+
+    void* node = get_page(pager, page_num);
+    uint32_t cell_num = leaf_node_lower_bound(node, key);
+    if (cell_num == *leaf_node_num_cells(node) || *leaf_node_key(node, cell_num) != key) {
+        unpin_page(pager, page_num);
+        return false;
+    }
+    Row row;
+    deserialize_row(key, leaf_node_value(node, cell_num), &row);
+    mark_page_dirty(pager, page_num);
+    leaf_node_delete_cell(node, cell_num);
+    bool underfull = !is_node_root(node) && leaf_node_underfull(node);
+    unpin_page(pager, page_num);
+
+    if (underfull) {
+        btree_rebalance(table, path, depth, key);
+    }
+    for (uint32_t i = 0; i < table->num_indexes; i++) {
+        char* value = row_column(&row, table->indexes[i].column);
+        index_delete(table, &table->indexes[i], index_entry(key, value, strlen(value)));
+    }
+    return true;
+}
+
+/**
+ * Bulk load
+ * Rows arrive in key order and are appended to the rightmost leaf. A full leaf
+ * is closed and its (max key, page) is appended to the rightmost node one level
+ * up, which in turn is closed when full, so every level is built left to right
+ * in one pass without searches or splits. At the end the topmost node is copied
+ * into the root page.
+ *
+ * The new pages are written straight to the db file instead of through the log:
+ * nothing points to them until the root is replaced, and the db file is synced
+ * before that last (logged) step.
+ **/
+typedef enum {
+    BULK_LOAD_SUCCESS,
+    BULK_LOAD_TABLE_NOT_EMPTY,
+    BULK_LOAD_DUPLICATE_KEY,
+    BULK_LOAD_UNSORTED
+} BulkLoadResult;
+
+typedef struct {
+    uint32_t page_num;      // node being filled, pinned; INVALID_PAGE_NUM before the first one
+    uint32_t nodes_closed;
+    uint32_t last_child_max_key;
+} BulkLoadLevel;
+
+struct BulkLoader_t {
+    Table* table;
+    bool presorted;
+    uint32_t leaf_fill;     // bytes of cells and slots per leaf
+    double internal_fill;   // share of the keys an internal node could hold
+
+    Row* rows;              // buffered input when it still has to be sorted
+    uint32_t num_rows;
+    uint32_t rows_capacity;
+
+    bool has_rows;
+    uint32_t last_key;
+    BulkLoadResult error;
+    uint32_t pages_since_flush;
+    uint32_t first_page_num;    // the load's pages are this one and every later one
+    uint32_t num_levels;    // level 0 is the leaves
+    BulkLoadLevel levels[BTREE_MAX_HEIGHT + 1];
+};
+typedef struct BulkLoader_t BulkLoader;
+
+/**
+ * Start a bulk load into an empty table. With presorted the rows must arrive
+ * in increasing id order and are streamed straight into pages; otherwise they
+ * are buffered and sorted in bulk_load_finish.
+ **/
+BulkLoader* bulk_load_begin(Table* table, double fill_factor, bool presorted) {
+    BulkLoader* loader = (BulkLoader*) malloc(sizeof(BulkLoader));
+    loader->table = table;
+    loader->presorted = presorted;
+    if (fill_factor <= 0 || fill_factor > 1) {
+        fill_factor = BULK_LOAD_FILL_FACTOR;
+    }
+    loader->leaf_fill = (uint32_t)(LEAF_NODE_SPACE_FOR_CELLS * fill_factor);
+    loader->internal_fill = fill_factor;
+    if (loader->leaf_fill < 1) loader->leaf_fill = 1;
+
+    loader->rows = NULL;
+    loader->num_rows = 0;
+    loader->rows_capacity = 0;
+    loader->has_rows = false;
+    loader->last_key = 0;
+    loader->error = BULK_LOAD_SUCCESS;
+    loader->pages_since_flush = 0;
+    loader->first_page_num = table->pager->num_pages;
+    loader->num_levels = 0;
+
+    void* root = get_page(table->pager, table->root_page_num);
+    bool empty = get_node_type(root) == NODE_LEAF && *leaf_node_num_cells(root) == 0;
+    unpin_page(table->pager, table->root_page_num);
+    if (!empty) {
+        loader->error = BULK_LOAD_TABLE_NOT_EMPTY;
+        return loader;
+    }
+
+    // Anything still pending belongs to earlier statements and goes through the log first,
+    // and the log is synced before the load starts flushing their frames along with its own
+    pager_commit(table->pager);
+    if (table->pager->wal != NULL) {
+        wal_sync(table->pager->wal);
+    }
+    table->pager->skip_wal = true;
+    return loader;
+}
+
+uint32_t bulk_load_new_page(BulkLoader* loader, NodeType type) {
+    Pager* pager = loader->table->pager;
+    if (loader->pages_since_flush >= BULK_LOAD_FLUSH_PAGES) {
+        pager_flush_dirty(pager);
+        loader->pages_since_flush = 0;
+    }
+    uint32_t page_num = get_unused_page_num(pager);
+    void* node = get_page(pager, page_num);
+    mark_page_dirty(pager, page_num);
+    if (type == NODE_LEAF) {
+        initialize_leaf_node(node);
+    } else {
+        initialize_internal_node(node);
+    }
+    loader->pages_since_flush++;
+    return page_num;
+}
+
+/**
+ * Append a closed child to the rightmost node of internal level `level`.
+ **/
+void bulk_load_push(BulkLoader* loader, uint32_t level, uint32_t max_key, uint32_t child_page_num) {
+    Pager* pager = loader->table->pager;
+    if (level > BTREE_MAX_HEIGHT) {
+        printf("Tree is deeper than %d levels.\n", BTREE_MAX_HEIGHT);
+        exit(EXIT_FAILURE);
+    }
+    if (level == loader->num_levels) {
+        loader->levels[level].page_num = INVALID_PAGE_NUM;
+        loader->levels[level].nodes_closed = 0;
+        loader->num_levels++;
+    }
+    BulkLoadLevel* current = &loader->levels[level];
+
+    if (current->page_num != INVALID_PAGE_NUM) {
+        void* node = get_page(pager, current->page_num);
+        uint32_t num_keys = *internal_node_num_keys(node);
+        uint32_t max_keys = internal_node_max_keys(node, current->last_child_max_key);
+        unpin_page(pager, current->page_num);
+        if (num_keys >= 1 && num_keys + 1 > max_keys * loader->internal_fill) {
+            bulk_load_push(loader, level + 1, current->last_child_max_key, current->page_num);
+            unpin_page(pager, current->page_num);
+            current->nodes_closed++;
+            current->page_num = INVALID_PAGE_NUM;
+        }
+    }
+
+    if (current->page_num == INVALID_PAGE_NUM) {
+        current->page_num = bulk_load_new_page(loader, NODE_INTERNAL);
+        *internal_node_right_child(get_page(pager, current->page_num)) = child_page_num;
+        unpin_page(pager, current->page_num);
+    } else {
+        // The previous right child becomes a regular cell keyed by its max key
+        void* node = get_page(pager, current->page_num);
+        mark_page_dirty(pager, current->page_num);  // may have been flushed since it was opened
+        internal_node_insert_cell(node, *internal_node_num_keys(node), current->last_child_max_key,
+                                  child_page_num);
+        unpin_page(pager, current->page_num);
+    }
+    current->last_child_max_key = max_key;
+}
+
+void bulk_load_append(BulkLoader* loader, Row* row) {
+    Pager* pager = loader->table->pager;
+    if (loader->has_rows && row->id <= loader->last_key) {
+        loader->error = row->id == loader->last_key ? BULK_LOAD_DUPLICATE_KEY : BULK_LOAD_UNSORTED;
+        return;
+    }
+
+    if (loader->num_levels == 0) {
+        loader->levels[0].page_num = bulk_load_new_page(loader, NODE_LEAF);
+        loader->levels[0].nodes_closed = 0;
+        loader->num_levels = 1;
+    }
+    BulkLoadLevel* leaves = &loader->levels[0];
+    void* leaf = get_page(pager, leaves->page_num);
+    uint32_t num_cells = *leaf_node_num_cells(leaf);
+    uint32_t value_size = row_value_size(row);
+    uint32_t used = LEAF_NODE_SPACE_FOR_CELLS - leaf_node_free_space(leaf);
+
+    if (num_cells > 0 && used + LEAF_NODE_KEY_SIZE + value_size + LEAF_NODE_SLOT_SIZE > loader->leaf_fill) {
+        // Close the full leaf: link it to a fresh one and hand it to its parent
+        uint32_t next_page_num = bulk_load_new_page(loader, NODE_LEAF);
+        mark_page_dirty(pager, leaves->page_num);
+        *leaf_node_next_leaf(leaf) = next_page_num;
+        unpin_page(pager, leaves->page_num);
+        bulk_load_push(loader, 1, loader->last_key, leaves->page_num);
+        unpin_page(pager, leaves->page_num);
+        leaves->nodes_closed++;
+        leaves->page_num = next_page_num;
+        leaf = get_page(pager, next_page_num);
+        num_cells = 0;
+    }
+    mark_page_dirty(pager, leaves->page_num);
+
+    serialize_row(row, leaf_node_insert_cell(leaf, num_cells, row->id, value_size));
+    unpin_page(pager, leaves->page_num);
+
+    loader->has_rows = true;
+    loader->last_key = row->id;
+}
+
+void bulk_load_add(BulkLoader* loader, Row* row) {
+    if (loader->error != BULK_LOAD_SUCCESS) {
+        return;
+    }
+    if (loader->presorted) {
+        bulk_load_append(loader, row);
+        return;
+    }
+    if (loader->num_rows == loader->rows_capacity) {
+        loader->rows_capacity = loader->rows_capacity ? loader->rows_capacity * 2 : 1024;
+        loader->rows = (Row*) realloc(loader->rows, sizeof(Row) * loader->rows_capacity);
+    }
+    loader->rows[loader->num_rows++] = *row;
+}
+
+int compare_rows_by_id(const void* a, const void* b) {
+    uint32_t id_a = ((const Row*)a)->id;
+    uint32_t id_b = ((const Row*)b)->id;
+    return (id_a > id_b) - (id_a < id_b);
+}
+
+/**
+ * Close every level, install the top node as the root and commit.
+ * On error the table is left as it was and the pages written so far are freed.
+ **/
+BulkLoadResult bulk_load_finish(BulkLoader* loader) {
+    Table* table = loader->table;
+    Pager* pager = table->pager;
+
+    if (loader->error != BULK_LOAD_TABLE_NOT_EMPTY && !loader->presorted) {
+        qsort(loader->rows, loader->num_rows, sizeof(Row), compare_rows_by_id);
+        for (uint32_t i = 0; i < loader->num_rows && loader->error == BULK_LOAD_SUCCESS; i++) {
+            bulk_load_append(loader, &loader->rows[i]);
+        }
+    }
+    free(loader->rows);
+
+    // Close each level's rightmost node; the first level with a single node holds the root
+    uint32_t top_page_num = INVALID_PAGE_NUM;
+    for (uint32_t level = 0; level < loader->num_levels; level++) {
+        BulkLoadLevel* current = &loader->levels[level];
+        if (current->page_num == INVALID_PAGE_NUM) {
+            continue;
+        }
+        if (loader->error == BULK_LOAD_SUCCESS && top_page_num == INVALID_PAGE_NUM) {
+            if (current->nodes_closed == 0 && level + 1 == loader->num_levels) {
+                top_page_num = current->page_num;
+            } else {
+                uint32_t max_key = level == 0 ? loader->last_key : current->last_child_max_key;
+                bulk_load_push(loader, level + 1, max_key, current->page_num);
+            }
+        }
+        unpin_page(pager, current->page_num);
+    }
+
+    BulkLoadResult result = loader->error;
+    if (result == BULK_LOAD_SUCCESS && top_page_num != INVALID_PAGE_NUM) {
+        // Everything below the root has to be on disk before the root points to it
+        pager_flush_dirty(pager);
+        if (fsync(pager->file_descriptor) == -1) {
+            printf("Error syncing db file: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+        pager->skip_wal = false;
+
+        void* top = get_page(pager, top_page_num);
+        void* root = get_page(pager, table->root_page_num);
+        mark_page_dirty(pager, table->root_page_num);
+        memcpy(root, top, PAGE_SIZE);
+        set_node_root(root, true);
+        unpin_page(pager, table->root_page_num);
+        unpin_page(pager, top_page_num);
+        free_page(pager, top_page_num);
+
+        for (uint32_t i = 0; i < table->num_indexes; i++) {
+            index_build(table, &table->indexes[i]);
+        }
+    }
+    pager->skip_wal = false;
+    if (result != BULK_LOAD_SUCCESS) {
+        uint32_t end_page_num = pager->num_pages;
+        for (uint32_t page_num = loader->first_page_num; page_num < end_page_num; page_num++) {
+            free_page(pager, page_num);
+            if (pager_commit_due(pager)) {
+                pager_commit(pager);
+            }
+        }
+    }
+    pager_commit(pager);
+
+    free(loader);
+    return result;
+}
+
+void indent(uint32_t level) {
+    for (uint32_t i = 0; i < level; i++) {
+        printf("  ");
+    }
+}
+
+/**
+ * Every node of the tree under page_num, each key of a node after the
+ * subtree left of it. Entries of index leaves show the hash and the row id.
+ * The cells of an internal node are copied out before its children are
+ * visited, so only one page is pinned at a time.
+ **/
+void print_tree(Pager* pager, uint32_t page_num, uint32_t indentation_level) {
+    void* node = get_page(pager, page_num);
+    if (get_node_type(node) == NODE_LEAF) {
+        uint32_t num_cells = *leaf_node_num_cells(node);
+        indent(indentation_level);
+        printf("- leaf %d (size %d)\n", page_num, num_cells);
+        for (uint32_t i = 0; i < num_cells; i++) {
+            indent(indentation_level + 1);
+            if (*node_format(node) == LEAF_FORMAT_INDEX) {
+                uint64_t entry = *index_leaf_entry(node, i);
+                printf("- %08x %d\n", (uint32_t)(entry >> 32), (uint32_t)entry);
+            } else {
+                printf("- %d\n", *leaf_node_key(node, i));
+            }
+        }
+        unpin_page(pager, page_num);
+        return;
+    }
+
+    uint32_t num_keys = *internal_node_num_keys(node);
+    uint32_t cells_size = sizeof(uint64_t) * num_keys + sizeof(uint32_t) * (num_keys + 1);
+    uint64_t* keys = (uint64_t*) arena_alloc(cells_size);
+    uint32_t* children = (uint32_t*) (keys + num_keys);
+    internal_node_get_cells(node, keys, children);
+    unpin_page(pager, page_num);
+
+    indent(indentation_level);
+    printf("- internal %d (size %d)\n", page_num, num_keys);
+    for (uint32_t i = 0; i < num_keys; i++) {
+        print_tree(pager, children[i], indentation_level + 1);
+        indent(indentation_level + 1);
+        printf("- key %llu\n", (unsigned long long)keys[i]);
+    }
+    print_tree(pager, children[num_keys], indentation_level + 1);
+    arena_free(keys, cells_size);
+}
+
+// Levels from the root down to the leaves, counting both
+uint32_t btree_height(Table* tree) {
+    uint32_t height = 1;
+    uint32_t page_num = tree->root_page_num;
+    void* node = get_page(tree->pager, page_num);
+    while (get_node_type(node) == NODE_INTERNAL) {
+        uint32_t child_num = *internal_node_child(node, 0);
+        unpin_page(tree->pager, page_num);
+        page_num = child_num;
+        node = get_page(tree->pager, page_num);
+        height++;
+    }
+    unpin_page(tree->pager, page_num);
+    return height;
+}
+
+const char* statement_type_name(StatementType type) {
+    switch (type) {
+        case (STATEMENT_INSERT):
+            return "insert";
+        case (STATEMENT_SELECT):
+            return "select";
+        case (STATEMENT_CREATE_INDEX):
+            return "create_index";
+        case (STATEMENT_DELETE):
+            return "delete";
+    }
+    return "";
+}
+
+/**
+ * Statements run so far go into the latency bucket of their duration, see Stats
+ **/
+void stats_record_statement(Stats* stats, StatementType type, uint64_t usec) {
+    uint32_t bucket = usec == 0 ? 0 : 64 - __builtin_clzll(usec);
+    if (bucket >= STATS_LATENCY_BUCKETS) {
+        bucket = STATS_LATENCY_BUCKETS - 1;
+    }
+    stats_add(&stats->statements[type], 1);
+    stats_add(&stats->latency[type][bucket], 1);
+}
+
+// The bucket the given fraction of the statements are in or below
+uint32_t stats_percentile_bucket(uint64_t* latency, uint64_t count, double fraction) {
+    uint64_t wanted = (uint64_t)(count * fraction + 0.999999);
+    uint64_t seen = 0;
+    for (uint32_t bucket = 0; bucket < STATS_LATENCY_BUCKETS - 1; bucket++) {
+        seen += stats_get(&latency[bucket]);
+        if (seen >= wanted) {
+            return bucket;
+        }
+    }
+    return STATS_LATENCY_BUCKETS - 1;
+}
+
+void print_latency_bucket(uint32_t bucket) {
+    if (bucket == 0) {
+        printf("< 1 us");
+    } else if (bucket == STATS_LATENCY_BUCKETS - 1) {
+        printf(">= %llu us", 1ULL << (bucket - 1));
+    } else {
+        printf("%llu-%llu us", 1ULL << (bucket - 1), 1ULL << bucket);
+    }
+}
+
+/**
+ * .stats prints the counters for people, .stats json as a single JSON object
+ * with the same names as in Stats, the height of the table's tree and, for
+ * each kind of statement, its count and latency buckets.
+ **/
+void print_stats(Table* table) {
+    Stats* stats = &table->pager->stats;
+    uint64_t hits = stats_get(&stats->page_hits);
+    uint64_t misses = stats_get(&stats->page_misses);
+    printf("Pages: %llu hits, %llu misses (%.1f%% hit rate), %llu read, %llu written, %llu logged\n",
+           (unsigned long long)hits, (unsigned long long)misses,
+           hits + misses > 0 ? 100.0 * hits / (hits + misses) : 0.0,
+           (unsigned long long)stats_get(&stats->pages_read),
+           (unsigned long long)stats_get(&stats->pages_written),
+           (unsigned long long)stats_get(&stats->pages_logged));
+    printf("Log: %llu commits, %llu checkpoints\n", (unsigned long long)stats_get(&stats->commits),
+           (unsigned long long)stats_get(&stats->checkpoints));
+    printf("Trees: height %d, %llu leaf splits, %llu internal splits, %llu root splits, %llu merges\n",
+           btree_height(table), (unsigned long long)stats_get(&stats->leaf_splits),
+           (unsigned long long)stats_get(&stats->internal_splits),
+           (unsigned long long)stats_get(&stats->root_splits),
+           (unsigned long long)stats_get(&stats->merges));
+    for (uint32_t type = 0; type < NUM_STATEMENT_TYPES; type++) {
+        uint64_t count = stats_get(&stats->statements[type]);
+        if (count == 0) {
+            continue;
+        }
+        uint64_t* latency = stats->latency[type];
+        printf("%s: %llu statements, p50 ", statement_type_name((StatementType)type), (unsigned long long)count);
+        print_latency_bucket(stats_percentile_bucket(latency, count, 0.50));
+        printf(", p99 ");
+        print_latency_bucket(stats_percentile_bucket(latency, count, 0.99));
+        printf("\n");
+        for (uint32_t bucket = 0; bucket < STATS_LATENCY_BUCKETS; bucket++) {
+            uint64_t in_bucket = stats_get(&latency[bucket]);
+            if (in_bucket > 0) {
+                printf("  ");
+                print_latency_bucket(bucket);
+                printf(": %llu\n", (unsigned long long)in_bucket);
+            }
+        }
+    }
+}
+
+void print_stats_json(Table* table) {
+    Stats* stats = &table->pager->stats;
+    printf("{\"page_hits\":%llu,\"page_misses\":%llu,\"pages_read\":%llu,\"pages_written\":%llu,"
+           "\"pages_logged\":%llu,\"commits\":%llu,\"checkpoints\":%llu,\"leaf_splits\":%llu,"
+           "\"internal_splits\":%llu,\"root_splits\":%llu,\"merges\":%llu,\"tree_height\":%d,\"statements\":{",
+           (unsigned long long)stats_get(&stats->page_hits), (unsigned long long)stats_get(&stats->page_misses),
+           (unsigned long long)stats_get(&stats->pages_read), (unsigned long long)stats_get(&stats->pages_written),
+           (unsigned long long)stats_get(&stats->pages_logged), (unsigned long long)stats_get(&stats->commits),
+           (unsigned long long)stats_get(&stats->checkpoints), (unsigned long long)stats_get(&stats->leaf_splits),
+           (unsigned long long)stats_get(&stats->internal_splits), (unsigned long long)stats_get(&stats->root_splits),
+           (unsigned long long)stats_get(&stats->merges), btree_height(table));
+    for (uint32_t type = 0; type < NUM_STATEMENT_TYPES; type++) {
+        printf("%s\"%s\":{\"count\":%llu,\"latency_us\":[", type > 0 ? "," : "",
+               statement_type_name((StatementType)type), (unsigned long long)stats_get(&stats->statements[type]));
+        for (uint32_t bucket = 0; bucket < STATS_LATENCY_BUCKETS; bucket++) {
+            printf("%s%llu", bucket > 0 ? "," : "", (unsigned long long)stats_get(&stats->latency[type][bucket]));
+        }
+        printf("]}");
+    }
+    printf("}}\n");
+}
+
+/**
+ * db methods
+ * */
+// The free list is the pager's and is kept as it is
+void meta_save(Table* table) {
+    void* meta = get_page(table->pager, META_PAGE_NUM);
+    mark_page_dirty(table->pager, META_PAGE_NUM);
+    bool is_meta = *meta_marker(meta) == META_PAGE_MARKER;
+    uint32_t freelist_head = is_meta ? *meta_freelist_head(meta) : 0;
+    uint32_t free_pages = is_meta ? *meta_free_pages(meta) : 0;
+    memset(meta, 0, PAGE_SIZE);
+    *meta_freelist_head(meta) = freelist_head;
+    *meta_free_pages(meta) = free_pages;
+    *meta_marker(meta) = META_PAGE_MARKER;
+    memcpy(meta_magic(meta), FILE_MAGIC, FILE_MAGIC_SIZE);
+    *meta_format_version(meta) = table->pager->format_version;
+    *meta_page_size(meta) = PAGE_SIZE;
+    *meta_table_root(meta) = table->root_page_num;
+    *meta_num_indexes(meta) = table->num_indexes;
+    for (uint32_t i = 0; i < table->num_indexes; i++) {
+        *meta_index_column(meta, i) = table->indexes[i].column;
+        *meta_index_root(meta, i) = table->indexes[i].root_page_num;
+    }
+    unpin_page(table->pager, META_PAGE_NUM);
+}
+
+/**
+ * Any number of statements may read the table at once, each from its own
+ * snapshot, next to one writer (see "Snapshots"). Reshaping the whole file, as
+ * an index build, an import or a vacuum do, needs the table to itself. With
+ * -mmap readers look at the mapping in place, so writers take the table
+ * exclusively as well. Each end_ call also resets the statement arena.
+ **/
+void table_begin_read(Table* table) {
+    pthread_rwlock_rdlock(&table->latch);
+    pager_begin_snapshot(table->pager);
+    thread_page_access = PAGE_ACCESS_SNAPSHOT;
+}
+
+void table_end_read(Table* table) {
+    arena_reset();
+    thread_page_access = PAGE_ACCESS_DIRECT;
+    pager_end_snapshot(table->pager);
+    pthread_rwlock_unlock(&table->latch);
+}
+
+void table_begin_write(Table* table) {
+    if (table->pager->use_mmap) {
+        pthread_rwlock_wrlock(&table->latch);
+        return;
+    }
+    pthread_rwlock_rdlock(&table->latch);
+    pthread_mutex_lock(&table->write_mutex);
+    thread_page_access = PAGE_ACCESS_WRITER;
+}
+
+void table_end_write(Table* table) {
+    arena_reset();
+    if (table->pager->use_mmap) {
+        pthread_rwlock_unlock(&table->latch);
+        return;
+    }
+    pager_publish(table->pager);
+    thread_page_access = PAGE_ACCESS_DIRECT;
+    pthread_mutex_unlock(&table->write_mutex);
+    pthread_rwlock_unlock(&table->latch);
+}
+
+void table_begin_exclusive(Table* table) {
+    pthread_rwlock_wrlock(&table->latch);
+}
+
+void table_end_exclusive(Table* table) {
+    arena_reset();
+    pthread_rwlock_unlock(&table->latch);
+}
+
+Table* db_open(const char* filename, PagerConfig* config) {
+    Pager* pager = pager_open(filename, config);
+
+    Table* table = (Table*)malloc(sizeof(Table));
+    table->pager = pager;
+    table->root_page_num = 1;
+    table->num_indexes = 0;
+    table->output_format = OUTPUT_TEXT;
+    table->output_fd = STDOUT_FILENO;
+    table->commit_interval = 1;
+    table->uncommitted_statements = 0;
+    table->scan_threads = DEFAULT_SCAN_THREADS;
+    pthread_rwlock_init(&table->latch, NULL);
+    pthread_mutex_init(&table->write_mutex, NULL);
+
+    if (pager->num_pages == 0) {
+        // New database file. Page 0 describes it, page 1 is the root leaf.
+        void* root_node = get_page(pager, table->root_page_num);
+        mark_page_dirty(pager, table->root_page_num);
+        initialize_leaf_node(root_node);
+        set_node_root(root_node, true);
+        unpin_page(pager, table->root_page_num);
+        meta_save(table);
+        return table;
+    }
+
+    void* meta = get_page(pager, META_PAGE_NUM);
+    if (*meta_marker(meta) != META_PAGE_MARKER) {
+        // Older files keep the root in page 0. Nothing points to it, so it
+        // can move to the end of the file to make room for the meta page.
+        table->root_page_num = pager->num_pages;
+        void* root_node = get_page(pager, table->root_page_num);
+        mark_page_dirty(pager, table->root_page_num);
+        memcpy(root_node, meta, PAGE_SIZE);
+        unpin_page(pager, table->root_page_num);
+        unpin_page(pager, META_PAGE_NUM);
+        meta_save(table);
+        pager_commit(pager);
+        return table;
+    }
+    table->root_page_num = *meta_table_root(meta);
+    table->num_indexes = *meta_num_indexes(meta);
+    if (table->num_indexes > TABLE_MAX_INDEXES) {
+        printf("Corrupt meta page: %d indexes.\n", table->num_indexes);
+        exit(EXIT_FAILURE);
+    }
+    for (uint32_t i = 0; i < table->num_indexes; i++) {
+        table->indexes[i].column = (Column)*meta_index_column(meta, i);
+        table->indexes[i].root_page_num = *meta_index_root(meta, i);
+    }
+    unpin_page(pager, META_PAGE_NUM);
+    
+    return table;
+}
+
+/**
+ * Shrink the file to the pages the trees use. Pages past the new end move into
+ * the free slots before it, then the pointers to them are rewritten: children
+ * of internal nodes, sibling links of leaves and the roots in the meta page.
+ * The old copies stay intact until the very end, so a tree committed half way
+ * still reads correctly. Returns the number of pages dropped.
+ **/
+uint32_t db_vacuum(Table* table) {
+    Pager* pager = table->pager;
+    pager_commit(pager);
+    uint32_t num_pages = pager->num_pages;
+
+    // Pages reachable from the meta page
+    bool* live = (bool*) calloc(num_pages, sizeof(bool));
+    uint32_t* live_pages = (uint32_t*) malloc(sizeof(uint32_t) * num_pages);
+    uint32_t num_live = 0;
+    live[META_PAGE_NUM] = true;
+    live_pages[num_live++] = META_PAGE_NUM;
+    uint32_t roots[TABLE_MAX_INDEXES + 1];
+    uint32_t num_roots = 0;
+    roots[num_roots++] = table->root_page_num;
+    for (uint32_t i = 0; i < table->num_indexes; i++) {
+        roots[num_roots++] = table->indexes[i].root_page_num;
+    }
+    for (uint32_t i = 0; i < num_roots; i++) {
+        live[roots[i]] = true;
+        live_pages[num_live++] = roots[i];
+    }
+    for (uint32_t next = 1; next < num_live; next++) {
+        void* node = get_page(pager, live_pages[next]);
+        if (get_node_type(node) == NODE_INTERNAL) {
+            for (uint32_t i = 0; i <= *internal_node_num_keys(node); i++) {
+                uint32_t child = *internal_node_child(node, i);
+                if (!live[child]) {
+                    live[child] = true;
+                    live_pages[num_live++] = child;
+                }
+            }
+        }
+        unpin_page(pager, live_pages[next]);
+    }
+
+    // Where each page ends up; the free list is rebuilt as empty, since its
+    // pages are about to be overwritten
+    uint32_t* new_page_num = (uint32_t*) malloc(sizeof(uint32_t) * num_pages);
+    for (uint32_t i = 0; i < num_pages; i++) {
+        new_page_num[i] = i;
+    }
+    void* meta = get_page(pager, META_PAGE_NUM);
+    mark_page_dirty(pager, META_PAGE_NUM);
+    *meta_freelist_head(meta) = 0;
+    *meta_free_pages(meta) = 0;
+    unpin_page(pager, META_PAGE_NUM);
+
+    uint32_t slot = 0;
+    for (uint32_t page_num = num_live; page_num < num_pages; page_num++) {
+        if (!live[page_num]) {
+            continue;
+        }
+        while (live[slot]) {
+            slot++;
+        }
+        new_page_num[page_num] = slot++;
+        void* source = get_page(pager, page_num);
+        void* destination = get_page(pager, new_page_num[page_num]);
+        mark_page_dirty(pager, new_page_num[page_num]);
+        memcpy(destination, source, PAGE_SIZE);
+        unpin_page(pager, new_page_num[page_num]);
+        unpin_page(pager, page_num);
+        if (pager_commit_due(pager)) {
+            pager_commit(pager);
+        }
+    }
+
+    for (uint32_t i = 1; i < num_live; i++) {
+        uint32_t page_num = new_page_num[live_pages[i]];
+        void* node = get_page(pager, page_num);
+        if (get_node_type(node) == NODE_INTERNAL) {
+            for (uint32_t child = 0; child <= *internal_node_num_keys(node); child++) {
+                uint32_t* child_page_num = internal_node_child(node, child);
+                if (new_page_num[*child_page_num] != *child_page_num) {
+                    mark_page_dirty(pager, page_num);
+                    *child_page_num = new_page_num[*child_page_num];
+                }
+            }
+        } else if (new_page_num[*leaf_node_next_leaf(node)] != *leaf_node_next_leaf(node)) {
+            mark_page_dirty(pager, page_num);
+            *leaf_node_next_leaf(node) = new_page_num[*leaf_node_next_leaf(node)];
+        }
+        unpin_page(pager, page_num);
+        if (pager_commit_due(pager)) {
+            pager_commit(pager);
+        }
+    }
+    table->root_page_num = new_page_num[table->root_page_num];
+    for (uint32_t i = 0; i < table->num_indexes; i++) {
+        table->indexes[i].root_page_num = new_page_num[table->indexes[i].root_page_num];
+    }
+    meta_save(table);
+
+    if (pager->wal != NULL) {
+        pager_commit(pager);
+        pager_checkpoint(pager);
+    }
+    pager_truncate(pager, num_live);
+
+    free(live);
+    free(live_pages);
+    free(new_page_num);
+    return num_pages - num_live;
+}
+
+void db_close(Table* table) {
+    Pager* pager = table->pager;
+    if (table->output_fd != STDOUT_FILENO) {
+        close(table->output_fd);
+    }
+
+    if (pager->wal != NULL) {
+        pager_commit(pager);
+        pager_checkpoint(pager);
+    } else {
+        pager_flush_dirty(pager);
+    }
+
+    if (pager->use_mmap) {
+        munmap(pager->map, MMAP_RESERVE_SIZE);
+        free(pager->map_dirty);
+        free(pager->map_checked);
+        // Drop the slack left by growing the file in MMAP_GROW_PAGES steps
+        if (ftruncate(pager->file_descriptor, (off_t)pager->num_pages * PAGE_SIZE) == -1) {
+            printf("Error truncating db file: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    int res = close(pager->file_descriptor);
+    if (res == -1) {
+        printf("Error closing db file.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (uint32_t i = 0; i < pager->num_frames; i++) {
+        free(pager->frames[i].data);
+        pthread_rwlock_destroy(&pager->frames[i].latch);
+    }
+    free(pager->frames);
+    version_prune(pager);
+    free(pager->versions);
+    free(pager->snapshots);
+    free(pager->page_table);
+    if (pager->wal != NULL) {
+        wal_close(pager->wal);
+    }
+    pthread_mutex_destroy(&pager->mutex);
+    pthread_cond_destroy(&pager->published);
+    free(pager);
+    num_open_pagers--;
+    pthread_rwlock_destroy(&table->latch);
+    pthread_mutex_destroy(&table->write_mutex);
+    free(table);
+}
+
+/**
+ * Input
+ * */
+InputBuffer* new_input_buffer() {
+    InputBuffer* input_buffer = (InputBuffer*)malloc(sizeof(InputBuffer));
+    input_buffer->buffer = NULL;
+    input_buffer->buffer_length = 0;
+    input_buffer->input_length = 0;
+    return input_buffer;
+}
+
+void print_prompt() {
+    printf("db > ");
+}
+
+void read_input(InputBuffer* input_buffer) {
+    ssize_t bytes_read = 
+                  getline(&(input_buffer->buffer), &(input_buffer->buffer_length), stdin);
+    if (bytes_read <= 0) {
+        printf("Error reading input.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    input_buffer->input_length = bytes_read - 1;
+    input_buffer->buffer[bytes_read - 1] = 0;
+}
+
+void close_input_buffer(InputBuffer* input_buffer) {
+    free(input_buffer->buffer);
+    free(input_buffer);
+}
+
+/**
+ * -batch reads statements from standard input BATCH_CHUNK_SIZE bytes at a time.
+ * Each line is handed out in place, terminated inside the chunk, and the unread
+ * tail moves to the front before the next read.
+ **/
+typedef struct {
+    int fd;
+    char* data;
+    size_t capacity;
+    size_t start;   // first byte not handed out yet
+    size_t end;     // end of the bytes read so far
+    bool eof;
+} BatchReader;
+
+BatchReader* batch_reader_open(int fd) {
+    BatchReader* reader = (BatchReader*) malloc(sizeof(BatchReader));
+    reader->fd = fd;
+    reader->capacity = BATCH_CHUNK_SIZE;
+    reader->data = (char*) malloc(reader->capacity);
+    reader->start = 0;
+    reader->end = 0;
+    reader->eof = false;
+    return reader;
+}
+
+void batch_reader_close(BatchReader* reader) {
+    free(reader->data);
+    free(reader);
+}
+
+void batch_reader_fill(BatchReader* reader) {
+    memmove(reader->data, reader->data + reader->start, reader->end - reader->start);
+    reader->end -= reader->start;
+    reader->start = 0;
+    // One byte stays free for the terminator of a last line without a newline
+    if (reader->end + 1 == reader->capacity) {
+        reader->capacity *= 2;
+        reader->data = (char*) realloc(reader->data, reader->capacity);
+    }
+
+    ssize_t bytes_read;
+    do {
+        bytes_read = read(reader->fd, reader->data + reader->end, reader->capacity - 1 - reader->end);
+    } while (bytes_read == -1 && errno == EINTR);
+    if (bytes_read == -1) {
+        printf("Error reading input: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+    if (bytes_read == 0) {
+        reader->eof = true;
+    }
+    reader->end += bytes_read;
+}
+
+/**
+ * Point input_buffer at the next non-empty line, false once the input is used up.
+ **/
+bool batch_read_input(BatchReader* reader, InputBuffer* input_buffer) {
+    while (true) {
+        char* line = reader->data + reader->start;
+        size_t available = reader->end - reader->start;
+        char* newline = (char*) memchr(line, '\n', available);
+        if (newline == NULL && !reader->eof) {
+            batch_reader_fill(reader);
+            continue;
+        }
+        if (newline == NULL && available == 0) {
+            return false;
+        }
+
+        size_t length = newline != NULL ? (size_t)(newline - line) : available;
+        reader->start += newline != NULL ? length + 1 : length;
+        if (length > 0 && line[length - 1] == '\r') {
+            length--;
+        }
+        if (length == 0) {
+            continue;
+        }
+        line[length] = 0;
+        input_buffer->buffer = line;
+        input_buffer->buffer_length = length + 1;
+        input_buffer->input_length = length;
+        return true;
+    }
+}
+
+/**
+ * Meta commands
+ * */
+
+void print_constants() {
+    printf("COMMON_NODE_HEADER_SIZE: %d\n", COMMON_NODE_HEADER_SIZE);
+    printf("LEAF_NODE_HEADER_SIZE: %d\n", LEAF_NODE_HEADER_SIZE);
+    printf("LEAF_NODE_MAX_CELL_SIZE: %d\n", LEAF_NODE_MAX_CELL_SIZE);
+    printf("LEAF_NODE_SPACE_FOR_CELLS: %d\n", LEAF_NODE_SPACE_FOR_CELLS);
+}
+
+/**
+ * .import <file> [sorted] [fill factor]
+ * One row per line: id, username and email separated by spaces, tabs or commas.
+ * "sorted" promises the file is already ordered by id, so rows are streamed
+ * into pages instead of being sorted in memory first.
+ **/
+void do_import(char* arguments, Table* table) {
+    char* filename = strtok(arguments, " ");
+    bool presorted = false;
+    double fill_factor = BULK_LOAD_FILL_FACTOR;
+    for (char* option = strtok(NULL, " "); option != NULL; option = strtok(NULL, " ")) {
+        if (strcmp(option, "sorted") == 0) {
+            presorted = true;
+            continue;
+        }
+        char* end;
+        fill_factor = strtod(option, &end);
+        if (*end != '\0' || !(fill_factor > 0 && fill_factor <= 1)) {
+            printf("Unknown .import option '%s', expected sorted or a fill factor in (0, 1].\n", option);
+            return;
+        }
+    }
+
+    FILE* file = filename ? fopen(filename, "r") : NULL;
+    if (file == NULL) {
+        printf("Unable to open '%s'.\n", filename ? filename : "");
+        return;
+    }
+
+    BulkLoader* loader = bulk_load_begin(table, fill_factor, presorted);
+    char* line = NULL;
+    size_t line_capacity = 0;
+    ssize_t line_length;
+    uint32_t line_num = 0;
+    uint32_t bad_lines = 0;
+    uint32_t num_rows = 0;
+    while ((line_length = getline(&line, &line_capacity, file)) != -1) {
+        line_num++;
+        if (line_length > 0 && line[line_length - 1] == '\n') {
+            line[--line_length] = 0;
+        }
+        if (line_length == 0) {
+            continue;
+        }
+        const char* separators = " ,\t\r";
+        char* id_string = strtok(line, separators);
+        char* username  = strtok(NULL, separators);
+        char* email     = strtok(NULL, separators);
+        Row row;
+        if (prepare_row(id_string, username, email, &row) != PREPARE_SUCCESS) {
+            if (bad_lines++ == 0) {
+                printf("Skipping bad row on line %d.\n", line_num);
+            }
+            continue;
+        }
+        bulk_load_add(loader, &row);
+        num_rows++;
+    }
+    free(line);
+    fclose(file);
+
+    switch (bulk_load_finish(loader)) {
+        case (BULK_LOAD_SUCCESS):
+            printf("Imported %d rows, skipped %d lines.\n", num_rows, bad_lines);
+            break;
+        case (BULK_LOAD_TABLE_NOT_EMPTY):
+            printf("Error: .import needs an empty table.\n");
+            break;
+        case (BULK_LOAD_DUPLICATE_KEY):
+            printf("Error: Duplicate key.\n");
+            break;
+        case (BULK_LOAD_UNSORTED):
+            printf("Error: Input is not sorted by id.\n");
+            break;
+    }
+}
+
+/**
+ * .mode text | csv | binary
+ **/
+void do_mode(char* mode, Table* table) {
+    if (strcmp(mode, "text") == 0) {
+        table->output_format = OUTPUT_TEXT;
+    } else if (strcmp(mode, "csv") == 0) {
+        table->output_format = OUTPUT_CSV;
+    } else if (strcmp(mode, "binary") == 0) {
+        table->output_format = OUTPUT_BINARY;
+    } else {
+        printf("Unknown mode '%s'.\n", mode);
+    }
+}
+
+/**
+ * .output <file> sends the rows of later selects to file, .output alone
+ * back to standard output.
+ **/
+void do_output(char* arguments, Table* table) {
+    char* filename = strtok(arguments, " ");
+    int fd = STDOUT_FILENO;
+    if (filename != NULL) {
+        fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, S_IWUSR | S_IRUSR);
+        if (fd == -1) {
+            printf("Unable to open '%s'.\n", filename);
+            return;
+        }
+    }
+    if (table->output_fd != STDOUT_FILENO) {
+        close(table->output_fd);
+    }
+    table->output_fd = fd;
+}
+
+MetaCommandResult do_meta_command(InputBuffer* input_buffer, Table* table) {
+    if(strcmp(input_buffer->buffer, ".exit") == 0) {
+        db_close(table);
+        exit(EXIT_SUCCESS);
+    } else if(strcmp(input_buffer->buffer, ".btree") == 0) {
+        table_begin_read(table);
+        printf("Tree: \n");
+        print_tree(table->pager, table->root_page_num, 0);
+        for (uint32_t i = 0; i < table->num_indexes; i++) {
+            printf("Index on %s:\n", column_name(table->indexes[i].column));
+            print_tree(table->pager, table->indexes[i].root_page_num, 0);
+        }
+        table_end_read(table);
+        return META_COMMAND_SUCCESS;
+    } else if(strcmp(input_buffer->buffer, ".stats") == 0 ||
+              strcmp(input_buffer->buffer, ".stats json") == 0) {
+        table_begin_read(table);
+        if (input_buffer->buffer[6] == ' ') {
+            print_stats_json(table);
+        } else {
+            print_stats(table);
+        }
+        table_end_read(table);
+        return META_COMMAND_SUCCESS;
+    } else if(strcmp(input_buffer->buffer, ".constants") == 0) {
+        printf("Constants:\n");
+        print_constants();
+        return META_COMMAND_SUCCESS;
+    } else if(strncmp(input_buffer->buffer, ".import ", 8) == 0) {
+        table_begin_exclusive(table);
+        do_import(input_buffer->buffer + 8, table);
+        table_end_exclusive(table);
+        return META_COMMAND_SUCCESS;
+    } else if(strcmp(input_buffer->buffer, ".vacuum") == 0) {
+        table_begin_exclusive(table);
+        uint32_t freed = db_vacuum(table);
+        table_end_exclusive(table);
+        printf("Freed %d pages.\n", freed);
+        return META_COMMAND_SUCCESS;
+    } else if(strncmp(input_buffer->buffer, ".mode ", 6) == 0) {
+        do_mode(input_buffer->buffer + 6, table);
+        return META_COMMAND_SUCCESS;
+    } else if(strncmp(input_buffer->buffer, ".output", 7) == 0 &&
+              (input_buffer->buffer[7] == 0 || input_buffer->buffer[7] == ' ')) {
+        do_output(input_buffer->buffer + 7, table);
+        return META_COMMAND_SUCCESS;
+    } else {
+        return META_COMMAND_UNRECOGNIZED_COMMAND;
+    }
+}
+void statement_add_param(Statement* statement, ParamTarget target, uint32_t row) {
+    // Grows in powers of two
+    if ((statement->num_params & (statement->num_params - 1)) == 0) {
+        uint32_t capacity = statement->num_params == 0 ? 1 : statement->num_params * 2;
+        statement->params = (Param*) realloc(statement->params, sizeof(Param) * capacity);
+    }
+    statement->params[statement->num_params].target = target;
+    statement->params[statement->num_params].row = row;
+    statement->num_params++;
+}
+
+void free_statement(Statement* statement) {
+    if (statement->rows_to_insert != &(statement->row_to_insert)) {
+        free(statement->rows_to_insert);
+    }
+    statement->rows_to_insert = &(statement->row_to_insert);
+    free(statement->params);
+    statement->params = NULL;
+    statement->num_params = 0;
+}
+
+/**
+ * Statement
+ * If the string it’s reading is larger than the buffer it’s reading into, 
+ * it will cause a buffer overflow and start writing into unexpected places. 
+ * We want to check the length of each string before we copy it into a Row structure. 
+ * And to do that, we need to divide the input by spaces.
+*/
+
+/**
+ * Several rows can be inserted at once by separating them with commas:
+ *   insert 1 user1 a@b.c, 2 user2 d@e.f
+ **/
+PrepareResult prepare_insert(InputBuffer* input_buffer, Statement* statement) {
+    statement->type = STATEMENT_INSERT;
+    statement->rows_to_insert = &(statement->row_to_insert);
+    statement->num_rows = 0;
+
+    uint32_t capacity = 1;
+    strtok(input_buffer->buffer, " ");  // the keyword
+    while (true) {
+        char* id_string = strtok(NULL, " ,");
+        if (id_string == NULL && statement->num_rows > 0) {
+            return PREPARE_SUCCESS;
+        }
+        char* username  = strtok(NULL, " ,");
+        char* email     = strtok(NULL, " ,");
+
+        if (statement->num_rows == capacity) {
+            capacity *= 2;
+            Row* rows = (Row*)malloc(sizeof(Row) * capacity);
+            memcpy(rows, statement->rows_to_insert, sizeof(Row) * statement->num_rows);
+            if (statement->rows_to_insert != &(statement->row_to_insert)) {
+                free(statement->rows_to_insert);
+            }
+            statement->rows_to_insert = rows;
+        }
+        PrepareResult result = prepare_row(id_string, username, email,
+                                           &(statement->rows_to_insert[statement->num_rows]));
+        if (result != PREPARE_SUCCESS) {
+            free_statement(statement);
+            return result;
+        }
+        if (strcmp(id_string, "?") == 0) {
+            statement_add_param(statement, PARAM_ID, statement->num_rows);
+        }
+        if (strcmp(username, "?") == 0) {
+            statement_add_param(statement, PARAM_USERNAME, statement->num_rows);
+        }
+        if (strcmp(email, "?") == 0) {
+            statement_add_param(statement, PARAM_EMAIL, statement->num_rows);
+        }
+        statement->num_rows++;
+    }
+}
+
+bool parse_column(const char* name, Column* column) {
+    if (strcmp(name, "id") == 0) {
+        *column = COLUMN_ID;
+    } else if (strcmp(name, "username") == 0) {
+        *column = COLUMN_USERNAME;
+    } else if (strcmp(name, "email") == 0) {
+        *column = COLUMN_EMAIL;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+/**
+ * id = a, id < a, id <= a, id > a, id >= a and id between a and b all become
+ * the range [where_low, where_high], which is empty when low > high.
+ **/
+void statement_set_id_range(Statement* statement) {
+    uint32_t value = statement->where_args[0];
+    statement->where_low = 0;
+    statement->where_high = UINT32_MAX;
+    switch (statement->where_op) {
+        case (ID_EQUAL):
+            statement->where_low = value;
+            statement->where_high = value;
+            break;
+        case (ID_BETWEEN):
+            statement->where_low = value;
+            statement->where_high = statement->where_args[1];
+            break;
+        case (ID_LESS):
+            if (value == 0) {
+                statement->where_low = 1;
+                statement->where_high = 0;
+            } else {
+                statement->where_high = value - 1;
+            }
+            break;
+        case (ID_LESS_EQUAL):
+            statement->where_high = value;
+            break;
+        case (ID_GREATER):
+            statement->where_low = value + 1;
+            break;
+        case (ID_GREATER_EQUAL):
+            statement->where_low = value;
+            break;
+    }
+}
+
+PrepareResult prepare_id_range(Statement* statement, char* op, char* value,
+                               char* and_word, char* high_value) {
+    bool between = strcmp(op, "between") == 0;
+    if (between != (and_word != NULL) ||
+        (between && (strcmp(and_word, "and") != 0 || high_value == NULL))) {
+        return PREPARE_SYNTAX_ERROR;
+    }
+    int low = atoi(value);
+    int high = between ? atoi(high_value) : low;
+    if (low < 0 || high < 0) {
+        return PREPARE_NEGATIVE_ID;
+    }
+
+    if (between) {
+        statement->where_op = ID_BETWEEN;
+    } else if (strcmp(op, "=") == 0) {
+        statement->where_op = ID_EQUAL;
+    } else if (strcmp(op, "<") == 0) {
+        statement->where_op = ID_LESS;
+    } else if (strcmp(op, "<=") == 0) {
+        statement->where_op = ID_LESS_EQUAL;
+    } else if (strcmp(op, ">") == 0) {
+        statement->where_op = ID_GREATER;
+    } else if (strcmp(op, ">=") == 0) {
+        statement->where_op = ID_GREATER_EQUAL;
+    } else {
+        return PREPARE_SYNTAX_ERROR;
+    }
+    if (strcmp(value, "?") == 0) {
+        statement_add_param(statement, PARAM_WHERE_VALUE, 0);
+    }
+    if (between && strcmp(high_value, "?") == 0) {
+        statement_add_param(statement, PARAM_WHERE_HIGH, 0);
+    }
+    statement->where_args[0] = low;
+    statement->where_args[1] = high;
+    statement_set_id_range(statement);
+    return PREPARE_SUCCESS;
+}
+
+PrepareResult prepare_where(Statement* statement);
+
+/**
+ * select [<columns>] [where ...]
+ * columns is a comma separated list of id, username and email, or *.
+ * The where clause is one of
+ *   where <username | email> = <value>
+ *   where id <= | < | = | > | >= <value>
+ *   where id between <low> and <high>
+ **/
+PrepareResult prepare_select(InputBuffer* input_buffer, Statement* statement) {
+    statement->type = STATEMENT_SELECT;
+    statement->has_where = false;
+    statement->columns = 0;
+
+    strtok(input_buffer->buffer, " ");  // the keyword
+    char* where = strtok(NULL, " ,");
+    for (; where != NULL && strcmp(where, "where") != 0; where = strtok(NULL, " ,")) {
+        Column selected;
+        if (strcmp(where, "*") == 0) {
+            statement->columns |= ALL_COLUMNS;
+        } else if (parse_column(where, &selected)) {
+            statement->columns |= COLUMN_BIT(selected);
+        } else {
+            return PREPARE_SYNTAX_ERROR;
+        }
+    }
+    if (statement->columns == 0) {
+        statement->columns = ALL_COLUMNS;
+    }
+    if (where == NULL) {
+        return PREPARE_SUCCESS;
+    }
+    return prepare_where(statement);
+}
+
+/**
+ * delete where ...
+ * takes the same where clauses as select.
+ **/
+PrepareResult prepare_delete(InputBuffer* input_buffer, Statement* statement) {
+    statement->type = STATEMENT_DELETE;
+    statement->has_where = false;
+    statement->columns = ALL_COLUMNS;
+
+    strtok(input_buffer->buffer, " ");  // the keyword
+    char* where = strtok(NULL, " ");
+    if (where == NULL || strcmp(where, "where") != 0) {
+        return PREPARE_SYNTAX_ERROR;
+    }
+    return prepare_where(statement);
+}
+
+// The rest of the input after the word "where"
+PrepareResult prepare_where(Statement* statement) {
+    char* column     = strtok(NULL, " ");
+    char* op         = strtok(NULL, " ");
+    char* value      = strtok(NULL, " ");
+    char* and_word   = strtok(NULL, " ");
+    char* high_value = strtok(NULL, " ");
+    if (column == NULL || op == NULL || value == NULL ||
+        strtok(NULL, " ") != NULL || !parse_column(column, &(statement->where_column))) {
+        return PREPARE_SYNTAX_ERROR;
+    }
+
+    if (statement->where_column == COLUMN_ID) {
+        PrepareResult result = prepare_id_range(statement, op, value, and_word, high_value);
+        statement->has_where = (result == PREPARE_SUCCESS);
+        return result;
+    }
+    if (strcmp(op, "=") != 0 || and_word != NULL) {
+        return PREPARE_SYNTAX_ERROR;
+    }
+    if (strlen(value) > COLUMN_EMAIL_SIZE) {
+        return PREPARE_STRING_TOO_LONG;
+    }
+    if (strcmp(value, "?") == 0) {
+        statement_add_param(statement, PARAM_WHERE_VALUE, 0);
+    }
+    strcpy(statement->where_value, value);
+    statement->has_where = true;
+    return PREPARE_SUCCESS;
+}
+
+/**
+ * create index on <username | email>
+ **/
+PrepareResult prepare_create_index(InputBuffer* input_buffer, Statement* statement) {
+    statement->type = STATEMENT_CREATE_INDEX;
+
+    strtok(input_buffer->buffer, " ");  // the keyword
+    char* index  = strtok(NULL, " ");
+    char* on     = strtok(NULL, " ");
+    char* column = strtok(NULL, " ");
+    if (index == NULL || strcmp(index, "index") != 0 || on == NULL || strcmp(on, "on") != 0 ||
+        column == NULL || strtok(NULL, " ") != NULL ||
+        !parse_column(column, &(statement->index_column)) ||
+        statement->index_column == COLUMN_ID) {
+        return PREPARE_SYNTAX_ERROR;
+    }
+    return PREPARE_SUCCESS;
+}
+
+PrepareResult prepare_statement(InputBuffer* input_buffer, Statement* statement) {
+    statement->rows_to_insert = &(statement->row_to_insert);
+    statement->num_rows = 0;
+    statement->params = NULL;
+    statement->num_params = 0;
+    if (strncmp(input_buffer->buffer, "insert", 6) == 0) {
+        return prepare_insert(input_buffer, statement);
+    }
+    if (strncmp(input_buffer->buffer, "select", 6) == 0) {
+        return prepare_select(input_buffer, statement);
+    }
+    if (strncmp(input_buffer->buffer, "create", 6) == 0) {
+        return prepare_create_index(input_buffer, statement);
+    }
+    if (strncmp(input_buffer->buffer, "delete", 6) == 0) {
+        return prepare_delete(input_buffer, statement);
+    }
+    return PREPARE_UNRECOGNIZED_STATEMENT;
+}
+
+/**
+ * Exuecute statements
+ * */
+// Whether any of the rows, sorted by id, has an id the table already holds
+bool table_has_any_id(Table* table, Row* rows, uint32_t num_rows) {
+    uint32_t next = 0;
+    while (next < num_rows) {
+        uint32_t upper_bound;
+        Cursor* cursor = table_find_bounded(table, rows[next].id, &upper_bound);
+        void* node = cursor->node;
+        uint32_t num_cells = *leaf_node_num_cells(node);
+        bool found = false;
+        do {
+            uint32_t index = leaf_node_lower_bound(node, rows[next].id);
+            found = index < num_cells && *leaf_node_key(node, index) == rows[next].id;
+            next++;
+        } while (!found && next < num_rows && rows[next].id <= upper_bound);
+        cursor_close(cursor);
+        if (found) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Rows are inserted in key order. One descent finds the leaf for the next row
+ * and the largest key that leaf may hold; the following rows up to that key are
+ * merged into it together while it has room. Once it is full the next row takes
+ * the usual split path and the descent starts over. A statement that repeats
+ * an id, or has one already in the table, is turned down as a duplicate key
+ * before any row goes in. A batch too large for the buffer pool is committed
+ * in several pieces.
+ **/
+ExecuteResult execute_insert(Statement* statement, Table* table) {
+    Row* rows = statement->rows_to_insert;
+    uint32_t num_rows = statement->num_rows;
+
+    if (num_rows > 1) {
+        qsort(rows, num_rows, sizeof(Row), compare_rows_by_id);
+        for (uint32_t i = 1; i < num_rows; i++) {
+            if (rows[i].id == rows[i - 1].id) {
+                return EXECUTE_DUPLICATE_KEY;
+            }
+        }
+    }
+    if (table_has_any_id(table, rows, num_rows)) {
+        return EXECUTE_DUPLICATE_KEY;
+    }
+
+    uint32_t next = 0;
+    while (next < num_rows) {
+        uint32_t upper_bound;
+        Cursor* cursor = table_find_bounded(table, rows[next].id, &upper_bound);
+
+        // The cursor points into the leaf that would hold the key, which is not the root
+        // once the tree has more than one level.
+        void* node = cursor->node;
+        uint32_t free_space = leaf_node_free_space(node);
+        uint32_t group_start = next;
+        uint32_t group_size = 0;
+        uint32_t group_bytes = 0;
+        bool leaf_full = false;
+        while (next < num_rows && rows[next].id <= upper_bound) {
+            uint32_t cell_bytes = LEAF_NODE_KEY_SIZE + row_value_size(&rows[next]) + LEAF_NODE_SLOT_SIZE;
+            if (group_bytes + cell_bytes > free_space) {
+                leaf_full = true;
+                break;
+            }
+            group_bytes += cell_bytes;
+            group_size++;
+            next++;
+        }
+        uint32_t leaf_page_num = cursor->page_num;
+        cursor_close(cursor);
+
+        if (group_size > 0) {
+            leaf_node_insert_sorted(table, leaf_page_num, &rows[group_start], group_size);
+            for (uint32_t i = group_start; i < group_start + group_size; i++) {
+                table_index_row(table, &rows[i]);
+            }
+        } else if (leaf_full) {
+            // The leaf splits, which needs the path down to it as well
+            uint32_t path[BTREE_MAX_HEIGHT];
+            uint32_t page_num;
+            uint32_t depth = table_find_path(table, rows[next].id, path, &page_num);
+            cursor = leaf_node_find(table, page_num, get_page(table->pager, page_num), rows[next].id);
+            leaf_node_insert(cursor, rows[next].id, &rows[next], path, depth);
+            cursor_close(cursor);
+            table_index_row(table, &rows[next]);
+            next++;
+        }
+        if (pager_commit_due(table->pager)) {
+            pager_commit(table->pager);
+        }
+    }
+
+    return EXECUTE_SUCCESS;
+}
+
+bool row_matches(Statement* statement, RowView* row) {
+    if (!statement->has_where) {
+        return true;
+    }
+    if (statement->where_column == COLUMN_ID) {
+        return row->id >= statement->where_low && row->id <= statement->where_high;
+    }
+    uint32_t length;
+    const char* value = row_view_column(row, statement->where_column, &length);
+    return length == strlen(statement->where_value) && memcmp(value, statement->where_value, length) == 0;
+}
+
+// Called for each row a statement matches, while the row's page is pinned
+typedef void (*RowCallback)(Statement* statement, RowView* row, void* context);
+
+// Pass the row with the given id on if there is one and it matches the statement
+void scan_row_by_id(Statement* statement, Table* table, uint32_t id, RowCallback callback, void* context) {
+    Cursor* cursor = table_find(table, id);
+    void* node = cursor->node;
+    if (cursor->cell_num < *leaf_node_num_cells(node) && *leaf_node_key(node, cursor->cell_num) == id) {
+        RowView row;
+        cursor_view(cursor, &row);
+        if (row_matches(statement, &row)) {
+            callback(statement, &row, context);
+        }
+    }
+    cursor_close(cursor);
+}
+
+/**
+ * Rows matching a string column through its index, in id order: all entries
+ * with the value's hash, from the first leaf that may hold one onwards.
+ * The ids of a leaf are taken out before their rows are looked up, so a
+ * reader holds one page at a time.
+ **/
+void scan_by_index(Statement* statement, Table* table, Index* index, RowCallback callback, void* context) {
+    Table tree = index_tree(table, index);
+    uint64_t hash = hash_string(statement->where_value, strlen(statement->where_value));
+    uint64_t next = hash << 32;
+    uint32_t* ids = (uint32_t*) arena_alloc(sizeof(uint32_t) * INDEX_LEAF_MAX_ENTRIES);
+
+    while (true) {
+        uint32_t page_num;
+        uint64_t upper_bound;
+        void* leaf = btree_find_leaf(&tree, next, &page_num, &upper_bound);
+        uint32_t num_entries = *leaf_node_num_cells(leaf);
+        uint32_t num_ids = 0;
+        bool done = upper_bound == UINT64_MAX;
+        for (uint32_t i = index_leaf_lower_bound(leaf, next); i < num_entries; i++) {
+            uint64_t entry = *index_leaf_entry(leaf, i);
+            if ((entry >> 32) != hash) {
+                done = true;
+                break;
+            }
+            ids[num_ids++] = (uint32_t)entry;
+        }
+        unpin_page(table->pager, page_num);
+
+        for (uint32_t i = 0; i < num_ids; i++) {
+            scan_row_by_id(statement, table, ids[i], callback, context);
+        }
+        if (done) {
+            break;
+        }
+        next = upper_bound + 1;
+    }
+    arena_free(ids, sizeof(uint32_t) * INDEX_LEAF_MAX_ENTRIES);
+}
+
+/**
+ * Every row matching the where clause of the statement, in id order. An index
+ * on the column is used when there is one, a range on id is handed to the
+ * cursor, anything else filters a full scan.
+ **/
+void scan_matching_rows(Statement* statement, Table* table, RowCallback callback, void* context) {
+    Index* index = statement->has_where ? table_index(table, statement->where_column) : NULL;
+    if (index != NULL) {
+        scan_by_index(statement, table, index, callback, context);
+        return;
+    }
+
+    Cursor* cursor;
+    if (statement->has_where && statement->where_column == COLUMN_ID) {
+        cursor = table_seek(table, statement->where_low, statement->where_high);
+    } else {
+        cursor = table_start(table);
+    }
+
+    RowView row;
+    while(!(cursor->end_of_table)) {
+        cursor_view(cursor, &row);
+        if (row_matches(statement, &row)) {
+            callback(statement, &row, context);
+        }
+        cursor_advance(cursor);
+    }
+    cursor_close(cursor);
+}
+
+/**
+ * Parallel scans
+ * A select that has to read every leaf can split the key space into ranges and
+ * have scan_threads workers scan them at once. The split keys are separators of
+ * the root, or of its children when the root has too few, spread out evenly.
+ * Workers take the ranges in key order, and the rows are written out in range
+ * order, so they come out in id order as from a single cursor. The worker on
+ * the range being written hands its rows to the writer a buffer at a time.
+ * The others hold theirs, but once the scan holds SCAN_HELD_BUFFERS buffers
+ * per worker they wait for the writer to catch up, so memory does not grow
+ * with the table.
+ *
+ * Workers read from the snapshot of the statement that starts them.
+ **/
+typedef struct {
+    uint32_t start_key;
+    uint32_t end_key;
+    ResultSink* held;       // buffers of rows not written out yet, oldest first
+    ResultSink* last_held;
+    bool done;
+} ScanRange;
+
+typedef struct {
+    Statement* statement;
+    Table* table;
+    ResultSink* sink;
+    ScanRange* ranges;
+    uint32_t num_ranges;
+    uint32_t num_workers;
+    PageAccess page_access;
+    uint64_t snapshot;
+    pthread_mutex_t mutex;      // guards everything below and the held buffers of every range
+    uint32_t next_range;        // the next one a worker takes
+    uint32_t head;              // the range being written out
+    uint32_t num_held;          // buffers held by all the ranges
+    uint32_t max_held;
+    pthread_cond_t progress;    // a range got buffers or was done
+    pthread_cond_t room;        // buffers were written out, or the head moved on
+} ParallelScan;
+
+// The separators of the top levels of the tree, in key order
+void scan_add_split_keys(Table* table, uint32_t page_num, uint32_t levels, uint64_t* keys, uint32_t* num_keys) {
     void* node = get_page(table->pager, page_num);
-    uint32_t num_cells = *leaf_node_num_cells(node);
+    if (get_node_type(node) != NODE_INTERNAL) {
+        unpin_page(table->pager, page_num);
+        return;
+    }
+    uint32_t node_keys = *internal_node_num_keys(node);
+    for (uint32_t i = 0; i <= node_keys; i++) {
+        if (levels > 1) {
+            scan_add_split_keys(table, *internal_node_child(node, i), levels - 1, keys, num_keys);
+        }
+        if (i < node_keys) {
+            keys[(*num_keys)++] = internal_node_key(node, i);
+        }
+    }
+    unpin_page(table->pager, page_num);
+}
 
-    Cursor* cursor = (Cursor* )malloc(sizeof(Cursor));
-    cursor->table = table;
-    cursor->page_num = page_num;
+/**
+ * Split the keys into at most max_ranges ranges along the tree, each holding
+ * about as many leaves. Returns the number of ranges, 1 when the root is a leaf.
+ **/
+uint32_t scan_split(Table* table, uint32_t max_ranges, ScanRange* ranges) {
+    Pager* pager = table->pager;
+    void* root = get_page(pager, table->root_page_num);
+    uint32_t root_keys = get_node_type(root) == NODE_INTERNAL ? *internal_node_num_keys(root) : 0;
+    unpin_page(pager, table->root_page_num);
+    uint32_t levels = root_keys + 1 >= max_ranges ? 1 : 2;
+
+    // No node holds more keys than fit at the narrowest width
+    uint32_t capacity = root_keys + (levels == 1 ? 0 : (root_keys + 1) * internal_node_capacity(1));
+    uint64_t* keys = (uint64_t*) malloc(sizeof(uint64_t) * (capacity + 1));
+    uint32_t num_keys = 0;
+    scan_add_split_keys(table, table->root_page_num, levels, keys, &num_keys);
+
+    uint32_t num_ranges = num_keys + 1 < max_ranges ? num_keys + 1 : max_ranges;
+    uint64_t start_key = 0;
+    uint32_t count = 0;
+    for (uint32_t i = 1; i <= num_ranges; i++) {
+        uint64_t end_key = i < num_ranges ? keys[(uint64_t)i * (num_keys + 1) / num_ranges - 1] : UINT32_MAX;
+        if (start_key > end_key) {
+            continue;
+        }
+        ranges[count].start_key = start_key;
+        ranges[count].end_key = end_key;
+        ranges[count].held = NULL;
+        ranges[count].last_held = NULL;
+        ranges[count].done = false;
+        count++;
+        start_key = end_key + 1;
+    }
+    free(keys);
+    return count;
+}
 
-    // Binary search
-    uint32_t min_index = 0;
-    uint32_t one_past_max_index = num_cells;
-
-    // The naming is pretty strange.... 
-    while (one_past_max_index != min_index) {
-        uint32_t index = (min_index + one_past_max_index) / 2;
-        uint32_t key_at_index = *leaf_node_key(node, index);
-        if (key == key_at_index) {
-            cursor->cell_num = index;
-            return cursor;
-        }
-        if (key < key_at_index) {
-            one_past_max_index = index;
+// The next range in key order, false once every one is taken
+bool scan_take_range(ParallelScan* scan, uint32_t* range_num) {
+    pthread_mutex_lock(&scan->mutex);
+    bool found = scan->next_range < scan->num_ranges;
+    if (found) {
+        *range_num = scan->next_range++;
+    }
+    pthread_mutex_unlock(&scan->mutex);
+    return found;
+}
+
+/**
+ * Move the buffers rows filled over to its range for the writer, first
+ * waiting for room unless the range is the one being written out.
+ **/
+void scan_hand_over(ParallelScan* scan, uint32_t range_num, ResultSink* rows, bool done) {
+    ScanRange* range = &scan->ranges[range_num];
+    pthread_mutex_lock(&scan->mutex);
+    if (rows->full != NULL) {
+        while (range_num != scan->head && scan->num_held >= scan->max_held) {
+            pthread_cond_wait(&scan->room, &scan->mutex);
+        }
+        for (ResultSink* full = rows->full; full != NULL; full = full->next) {
+            scan->num_held++;
+        }
+        if (range->last_held == NULL) {
+            range->held = rows->full;
         } else {
-            min_index = index + 1;
+            range->last_held->next = rows->full;
         }
+        range->last_held = rows->last_full;
+        rows->full = NULL;
+        rows->last_full = NULL;
     }
+    range->done = done;
+    pthread_cond_broadcast(&scan->progress);
+    pthread_mutex_unlock(&scan->mutex);
+}
 
-    cursor->cell_num = min_index;
-    return cursor;
+void* scan_worker(void* arg) {
+    ParallelScan* scan = (ParallelScan*)arg;
+    Statement* statement = scan->statement;
+    thread_page_access = scan->page_access;
+    thread_snapshot = scan->snapshot;
+
+    uint32_t range_num;
+    while (scan_take_range(scan, &range_num)) {
+        ScanRange* range = &scan->ranges[range_num];
+        ResultSink* rows = sink_open(RESULT_SINK_HELD, scan->sink->format);
+        Cursor* cursor = table_seek(scan->table, range->start_key, range->end_key);
+        RowView row;
+        while (!(cursor->end_of_table)) {
+            cursor_view(cursor, &row);
+            if (row_matches(statement, &row)) {
+                sink_row(rows, &row, statement->columns);
+                if (rows->full != NULL) {
+                    scan_hand_over(scan, range_num, rows, false);
+                }
+            }
+            cursor_advance(cursor);
+        }
+        cursor_close(cursor);
+
+        if (rows->length > 0) {
+            sink_flush(rows);
+        }
+        scan_hand_over(scan, range_num, rows, true);
+        free(rows);
+    }
+    thread_page_access = PAGE_ACCESS_DIRECT;
+    arena_reset();
+    return NULL;
+}
+
+/**
+ * Write the rows of a full scan to the sink with table->scan_threads workers.
+ * Returns false when the statement is better served by scan_matching_rows: it
+ * has an index or an id range to go by, or the table is a single leaf.
+ **/
+bool parallel_scan(Statement* statement, Table* table, ResultSink* sink) {
+    if (table->scan_threads < 2 || (statement->has_where &&
+        (statement->where_column == COLUMN_ID || table_index(table, statement->where_column) != NULL))) {
+        return false;
+    }
+    uint32_t max_ranges = table->scan_threads * SCAN_RANGES_PER_THREAD;
+    ScanRange* ranges = (ScanRange*) malloc(sizeof(ScanRange) * max_ranges);
+    uint32_t num_ranges = scan_split(table, max_ranges, ranges);
+    if (num_ranges < 2) {
+        free(ranges);
+        return false;
+    }
+
+    ParallelScan scan;
+    scan.statement = statement;
+    scan.table = table;
+    scan.sink = sink;
+    scan.ranges = ranges;
+    scan.num_ranges = num_ranges;
+    scan.num_workers = table->scan_threads < num_ranges ? table->scan_threads : num_ranges;
+    scan.page_access = thread_page_access;
+    scan.snapshot = thread_snapshot;
+    pthread_mutex_init(&scan.mutex, NULL);
+    scan.next_range = 0;
+    scan.head = 0;
+    scan.num_held = 0;
+    scan.max_held = scan.num_workers * SCAN_HELD_BUFFERS;
+    pthread_cond_init(&scan.progress, NULL);
+    pthread_cond_init(&scan.room, NULL);
+    pthread_t* threads = (pthread_t*) malloc(sizeof(pthread_t) * scan.num_workers);
+    for (uint32_t i = 0; i < scan.num_workers; i++) {
+        if (pthread_create(&threads[i], NULL, scan_worker, &scan) != 0) {
+            printf("Error starting scan thread.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    pthread_mutex_lock(&scan.mutex);
+    for (uint32_t i = 0; i < num_ranges; i++) {
+        ScanRange* range = &ranges[i];
+        scan.head = i;
+        pthread_cond_broadcast(&scan.room);
+        bool done = false;
+        while (!done) {
+            while (range->held == NULL && !range->done) {
+                pthread_cond_wait(&scan.progress, &scan.mutex);
+            }
+            ResultSink* held = range->held;
+            done = range->done;
+            range->held = NULL;
+            range->last_held = NULL;
+            pthread_mutex_unlock(&scan.mutex);
+            uint32_t num_written = sink_write_buffers(sink, held);
+            pthread_mutex_lock(&scan.mutex);
+            scan.num_held -= num_written;
+            pthread_cond_broadcast(&scan.room);
+        }
+    }
+    pthread_mutex_unlock(&scan.mutex);
+
+    for (uint32_t i = 0; i < scan.num_workers; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    pthread_cond_destroy(&scan.room);
+    pthread_cond_destroy(&scan.progress);
+    pthread_mutex_destroy(&scan.mutex);
+    free(threads);
+    free(ranges);
+    return true;
+}
+
+void sink_matching_row(Statement* statement, RowView* row, void* sink) {
+    sink_row((ResultSink*)sink, row, statement->columns);
+}
+
+void select_rows(Statement* statement, Table* table, ResultSink* sink) {
+    if (!parallel_scan(statement, table, sink)) {
+        scan_matching_rows(statement, table, sink_matching_row, sink);
+    }
+}
+
+ExecuteResult execute_select(Statement* statement, Table* table) {
+    ResultSink* sink = sink_open(table->output_fd, table->output_format);
+    select_rows(statement, table, sink);
+    sink_close(sink);
+    return EXECUTE_SUCCESS;
+}
+
+typedef struct {
+    uint32_t* ids;
+    uint32_t num_ids;
+    uint32_t capacity;
+} IdList;
+
+void collect_matching_id(Statement* /* statement */, RowView* row, void* list) {
+    IdList* ids = (IdList*)list;
+    if (ids->num_ids == ids->capacity) {
+        ids->capacity = ids->capacity == 0 ? 64 : ids->capacity * 2;
+        ids->ids = (uint32_t*) realloc(ids->ids, sizeof(uint32_t) * ids->capacity);
+    }
+    ids->ids[ids->num_ids++] = row->id;
+}
+
+/**
+ * The matching ids are collected first, then each row is deleted on its own,
+ * since deleting reshapes the leaves a scan would be walking.
+ **/
+ExecuteResult execute_delete(Statement* statement, Table* table) {
+    IdList ids = { NULL, 0, 0 };
+    scan_matching_rows(statement, table, collect_matching_id, &ids);
+    for (uint32_t i = 0; i < ids.num_ids; i++) {
+        table_delete(table, ids.ids[i]);
+        if (pager_commit_due(table->pager)) {
+            pager_commit(table->pager);
+        }
+    }
+    free(ids.ids);
+    return EXECUTE_SUCCESS;
+}
+
+ExecuteResult execute_create_index(Statement* statement, Table* table) {
+    if (table_index(table, statement->index_column) != NULL) {
+        return EXECUTE_INDEX_EXISTS;
+    }
+    Pager* pager = table->pager;
+    Index* index = &table->indexes[table->num_indexes++];
+    index->column = statement->index_column;
+    index->root_page_num = get_unused_page_num(pager);
+
+    void* root = get_page(pager, index->root_page_num);
+    mark_page_dirty(pager, index->root_page_num);
+    initialize_index_leaf(root);
+    set_node_root(root, true);
+    unpin_page(pager, index->root_page_num);
+
+    // Recorded once it is complete, so a build cut short leaves no index behind
+    index_build(table, index);
+    meta_save(table);
+    return EXECUTE_SUCCESS;
+}
+
+/**
+ * Every statement commits when it ends, except in -batch mode where
+ * commit_interval of them share a commit and log each page they touch once.
+ **/
+void table_end_statement(Table* table) {
+    if (++table->uncommitted_statements >= table->commit_interval ||
+        pager_commit_due(table->pager)) {
+        pager_commit(table->pager);
+        table->uncommitted_statements = 0;
+    }
+}
+
+/**
+ * Safe to call from several threads on the same table, see table_begin_read.
+ **/
+ExecuteResult execute_statement(Statement* statement, Table* table) {
+    uint64_t start_usec = now_usec();
+    ExecuteResult result = EXECUTE_SUCCESS;
+    switch (statement->type) {
+        case (STATEMENT_INSERT):
+            table_begin_write(table);
+            result = execute_insert(statement, table);
+            table_end_statement(table);
+            table_end_write(table);
+            break;
+        case (STATEMENT_SELECT):
+            table_begin_read(table);
+            result = execute_select(statement, table);
+            table_end_read(table);
+            break;
+        case (STATEMENT_CREATE_INDEX):
+            table_begin_exclusive(table);
+            result = execute_create_index(statement, table);
+            table_end_statement(table);
+            table_end_exclusive(table);
+            break;
+        case (STATEMENT_DELETE):
+            table_begin_write(table);
+            result = execute_delete(statement, table);
+            table_end_statement(table);
+            table_end_write(table);
+            break;
+    }
+    stats_record_statement(&table->pager->stats, statement->type, now_usec() - start_usec);
+    return result;
+}
+
+/**
+ * Prepared statements
+ * db_prepare parses a statement once. Every ? in place of a value is a
+ * parameter, numbered from 1 in the order they appear, which db_bind_int and
+ * db_bind_text set without going through the parser again. db_step runs the
+ * statement with the values bound so far and can be called any number of
+ * times, rebinding in between:
+ *
+ *   PreparedStatement* insert;
+ *   db_prepare(table, "insert ? ? ?", &insert);
+ *   for (...) {
+ *       db_bind_int(insert, 1, id);
+ *       db_bind_text(insert, 2, username);
+ *       db_bind_text(insert, 3, email);
+ *       db_step(insert);
+ *   }
+ *   db_finalize(insert);
+ **/
+typedef struct {
+    Table* table;
+    Statement statement;
+    Row* rows;      // scratch copy for a multi-row insert, which sorts its rows in place
+} PreparedStatement;
+
+PrepareResult db_prepare(Table* table, const char* sql, PreparedStatement** prepared) {
+    InputBuffer input;
+    input.buffer = strdup(sql);
+    input.buffer_length = strlen(sql) + 1;
+    input.input_length = strlen(sql);
+
+    PreparedStatement* result = (PreparedStatement*) malloc(sizeof(PreparedStatement));
+    result->table = table;
+    result->rows = NULL;
+    PrepareResult prepare_result = prepare_statement(&input, &(result->statement));
+    free(input.buffer);
+    if (prepare_result != PREPARE_SUCCESS) {
+        free_statement(&(result->statement));
+        free(result);
+        *prepared = NULL;
+        return prepare_result;
+    }
+
+    if (result->statement.num_rows > 1) {
+        result->rows = (Row*) malloc(sizeof(Row) * result->statement.num_rows);
+    }
+    *prepared = result;
+    return PREPARE_SUCCESS;
+}
+
+Param* db_param(PreparedStatement* prepared, uint32_t param_num) {
+    if (param_num == 0 || param_num > prepared->statement.num_params) {
+        return NULL;
+    }
+    return &(prepared->statement.params[param_num - 1]);
+}
+
+PrepareResult db_bind_int(PreparedStatement* prepared, uint32_t param_num, int value) {
+    Statement* statement = &(prepared->statement);
+    Param* param = db_param(prepared, param_num);
+    if (param == NULL) {
+        return PREPARE_SYNTAX_ERROR;
+    }
+    if (value < 0) {
+        return PREPARE_NEGATIVE_ID;
+    }
+    switch (param->target) {
+        case (PARAM_ID):
+            statement->rows_to_insert[param->row].id = value;
+            return PREPARE_SUCCESS;
+        case (PARAM_WHERE_VALUE):
+        case (PARAM_WHERE_HIGH):
+            if (statement->where_column != COLUMN_ID) {
+                return PREPARE_SYNTAX_ERROR;
+            }
+            statement->where_args[param->target == PARAM_WHERE_HIGH] = value;
+            statement_set_id_range(statement);
+            return PREPARE_SUCCESS;
+        default:
+            return PREPARE_SYNTAX_ERROR;
+    }
+}
+
+PrepareResult db_bind_text(PreparedStatement* prepared, uint32_t param_num, const char* value) {
+    Statement* statement = &(prepared->statement);
+    Param* param = db_param(prepared, param_num);
+    if (param == NULL) {
+        return PREPARE_SYNTAX_ERROR;
+    }
+    char* destination;
+    size_t max_length;
+    switch (param->target) {
+        case (PARAM_USERNAME):
+            destination = statement->rows_to_insert[param->row].username;
+            max_length = COLUMN_USERNAME_SIZE;
+            break;
+        case (PARAM_EMAIL):
+            destination = statement->rows_to_insert[param->row].email;
+            max_length = COLUMN_EMAIL_SIZE;
+            break;
+        case (PARAM_WHERE_VALUE):
+            if (statement->where_column == COLUMN_ID) {
+                return PREPARE_SYNTAX_ERROR;
+            }
+            destination = statement->where_value;
+            max_length = COLUMN_EMAIL_SIZE;
+            break;
+        default:
+            return PREPARE_SYNTAX_ERROR;
+    }
+    if (strlen(value) > max_length) {
+        return PREPARE_STRING_TOO_LONG;
+    }
+    strcpy(destination, value);
+    return PREPARE_SUCCESS;
+}
+
+ExecuteResult db_step(PreparedStatement* prepared) {
+    if (prepared->rows == NULL) {
+        return execute_statement(&(prepared->statement), prepared->table);
+    }
+    Statement run = prepared->statement;
+    memcpy(prepared->rows, run.rows_to_insert, sizeof(Row) * run.num_rows);
+    run.rows_to_insert = prepared->rows;
+    return execute_statement(&run, prepared->table);
+}
+
+void db_finalize(PreparedStatement* prepared) {
+    free_statement(&(prepared->statement));
+    free(prepared->rows);
+    free(prepared);
+}
+
+/**
+ * main
+ * */
+/**
+ * Server
+ * With -server the database is served over a socket instead of the REPL: a
+ * TCP port on the loopback interface, or a Unix socket when the address is a
+ * path. Every connection shares the one Table and its buffer pool, and a
+ * single thread serves them all from an epoll loop.
+ *
+ * A request is a u32 length followed by that many bytes of statement text, as
+ * typed at the prompt. A reply is a u32 length followed by a status byte and
+ * the payload: the rows of a select in the binary output format, or the error
+ * message when the status is SERVER_ERROR. A client may send any number of
+ * requests without waiting for replies; they run, and are answered, in order.
+ * Integers are little-endian.
+ **/
+typedef enum {
+    SERVER_OK,
+    SERVER_ERROR
+} ServerStatus;
+
+struct Connection_t {
+    int fd;
+    char* input;            // requests received and not run yet
+    uint32_t input_length;
+    uint32_t input_capacity;
+    char* output;           // replies not sent yet, from output_sent on
+    uint32_t output_length;
+    uint32_t output_capacity;
+    uint32_t output_sent;
+    uint32_t events;        // what the connection waits for in epoll
+    bool closing;           // the client is done sending, or broke the protocol
+    struct Connection_t* prev;
+    struct Connection_t* next;
+};
+typedef struct Connection_t Connection;
+
+typedef struct {
+    Table* table;
+    int listen_fd;
+    int epoll_fd;
+    Connection* connections;    // every open one
+} Server;
+
+static volatile sig_atomic_t server_stopping = 0;
+
+void server_stop(int /* signal_number */) {
+    server_stopping = 1;
+}
+
+bool server_is_port(const char* address) {
+    return address[0] != '\0' && strspn(address, "0123456789") == strlen(address);
+}
+
+// The listening socket for a port number or a socket path
+int server_listen(const char* address) {
+    int fd;
+    if (server_is_port(address)) {
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd == -1) {
+            printf("Unable to create socket: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+        int reuse = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = htons(atoi(address));
+        if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+            printf("Unable to listen on port %s: %d\n", address, errno);
+            exit(EXIT_FAILURE);
+        }
+    } else {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (strlen(address) >= sizeof(addr.sun_path)) {
+            printf("Socket path '%s' is too long.\n", address);
+            exit(EXIT_FAILURE);
+        }
+        strcpy(addr.sun_path, address);
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd == -1) {
+            printf("Unable to create socket: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+        // A socket left behind by an earlier run; anything else at the path is kept
+        struct stat existing;
+        if (lstat(address, &existing) == 0) {
+            if (!S_ISSOCK(existing.st_mode)) {
+                printf("'%s' exists and is not a socket.\n", address);
+                exit(EXIT_FAILURE);
+            }
+            unlink(address);
+        }
+        if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+            printf("Unable to listen on '%s': %d\n", address, errno);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (listen(fd, SOMAXCONN) == -1) {
+        printf("Unable to listen on '%s': %d\n", address, errno);
+        exit(EXIT_FAILURE);
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
 }
 
-Cursor* table_find(Table* table, uint32_t key) {
-    
-    uint32_t root_page_num = table->root_page_num;
-
-    void* root_node = get_page(table->pager, table->root_page_num);
-    
-    if (get_node_type(root_node) == NODE_LEAF) {
-        return leaf_node_find(table, root_page_num, key);
-    } else {
-         printf("Need to implement searching an internal node\n");
-          exit(EXIT_FAILURE);
+char* connection_reserve(Connection* connection, uint32_t length) {
+    uint32_t needed = connection->output_length + length;
+    if (needed > connection->output_capacity) {
+        while (connection->output_capacity < needed) {
+            connection->output_capacity *= 2;
+        }
+        connection->output = (char*) realloc(connection->output, connection->output_capacity);
     }
+    char* dest = connection->output + connection->output_length;
+    connection->output_length = needed;
+    return dest;
 }
 
-void* cursor_value(Cursor* cursor) {
-
-    uint32_t page_num = cursor->page_num;
-    
-    void* page = get_page(cursor->table->pager, page_num);
-    
-    return leaf_node_value(page, cursor->cell_num);
+// The start of a reply whose payload of payload_length bytes comes next
+void connection_reply_header(Connection* connection, ServerStatus status, uint32_t payload_length) {
+    char* dest = connection_reserve(connection, sizeof(uint32_t) + 1);
+    uint32_t reply_length = 1 + payload_length;
+    memcpy(dest, &reply_length, sizeof(uint32_t));
+    dest[sizeof(uint32_t)] = status;
 }
 
-void cursor_advance(Cursor* cursor) {
-    uint32_t page_num =cursor->page_num;
-    void* node = get_page(cursor->table->pager, page_num);
-
-    cursor->cell_num += 1;
+void connection_reply(Connection* connection, ServerStatus status, const char* payload, uint32_t length) {
+    connection_reply_header(connection, status, length);
+    memcpy(connection_reserve(connection, length), payload, length);
+}
 
-    if (cursor->cell_num >= (*leaf_node_num_cells(node))) {
-        cursor->end_of_table = true;
-    }
+void connection_reply_error(Connection* connection, const char* message) {
+    connection_reply(connection, SERVER_ERROR, message, strlen(message));
 }
 
 /**
- * Node methods 
+ * The rows of a select go straight into the output of the connection behind
+ * a header whose length is filled in once the select is done. A result
+ * longer than SERVER_MAX_REPLY is dropped and answered with an error.
  **/
-bool is_node_root(void* node) {
-    uint8_t value = *((uint8_t*)(node + IS_ROOT_OFFSET));
-    return (bool)value;
+typedef struct {
+    Connection* connection;
+    uint32_t reply_offset;      // where the header of the reply starts in the output
+    bool too_long;
+} RowsReply;
+
+void rows_reply_write(void* target, const char* data, uint32_t length) {
+    RowsReply* reply = (RowsReply*)target;
+    Connection* connection = reply->connection;
+    uint32_t payload_length = connection->output_length - reply->reply_offset - sizeof(uint32_t) - 1;
+    if (reply->too_long || length > SERVER_MAX_REPLY - payload_length) {
+        reply->too_long = true;
+        return;
+    }
+    memcpy(connection_reserve(connection, length), data, length);
 }
 
-void set_node_root(void* node, bool is_root) {
-    uint8_t value = is_root;
-    *((uint8_t*)(node + IS_ROOT_OFFSET)) = value;
+ResultSink* connection_reply_rows_begin(Connection* connection, RowsReply* reply) {
+    reply->connection = connection;
+    reply->reply_offset = connection->output_length;
+    reply->too_long = false;
+    connection_reply_header(connection, SERVER_OK, 0);
+    return sink_open_writer(rows_reply_write, reply, OUTPUT_BINARY);
 }
 
-
-//Let N be the root node. First allocate two nodes, 
-//say L and R. Move lower half of N into L and the upper half into R. 
-//Now N is empty. Add 〈L, K,R〉 in N, where K is the max key in L.
-// Page N remains the root. Note that the depth of the tree has increased by one, 
-//but the new tree remains height balanced without violating any B+-tree property.
-
-void create_new_root(Table* table, uint32_t right_child_page_num) {
-  /*
-   Handle splitting the root.
-   Old root copied to new page, becomes left child.
-   Address of right child passed in.
-   Re-initialize root page to contain the new root node.
-   New root node points to two children.
-   */
-    void* root        = get_page(table->pager, table->root_page_num);
-    void* right_child = get_page(table->pager, right_child_page_num);
-    uint32_t left_child_page_num = get_unused_page_num(table->pager);
-
-    void* left_child  = get_page(table->pager, left_child_page_num);
-
-    // Left child has data copied from old root
-    memcpy(left_child, root, PAGE_SIZE);
-    set_node_root(left_child, false);
-
-
-    // Initialize the root page as a new internal node with two children
-    initialize_internal_node(root);
-    set_node_root(root, true);
-
-    *internal_node_num_keys(root) = 1;
-    *internal_node_child(root, 0) = left_child_page_num;
-    uint32_t left_child_max_key = get_node_max_key(left_child);
-    *internal_node_key(root, 0) = left_child_max_key;
-    *internal_node_right_child(root) = right_child_page_num;
+// Write out the rest of the rows and fill in the length of the reply. Frees the sink.
+void connection_reply_rows_end(Connection* connection, RowsReply* reply, ResultSink* rows) {
+    sink_close(rows);
+    if (reply->too_long) {
+        connection->output_length = reply->reply_offset;
+        connection_reply_error(connection, "Result is too long.");
+        return;
+    }
+    uint32_t reply_length = connection->output_length - reply->reply_offset - sizeof(uint32_t);
+    memcpy(connection->output + reply->reply_offset, &reply_length, sizeof(uint32_t));
 }
 
+const char* server_prepare_error(PrepareResult result) {
+    switch (result) {
+        case (PREPARE_NEGATIVE_ID):
+            return "Id must be postive number.";
+        case (PREPARE_STRING_TOO_LONG):
+            return "String is too long.";
+        case (PREPARE_SYNTAX_ERROR):
+            return "Syntax error. Could not parse statement.";
+        default:
+            return "Unrecognized keyword at start of statement.";
+    }
+}
 
-void leaf_node_split_and_insert(Cursor* cursor, uint32_t key, Row* value) {
-    /*
-    Create a new node and move half the cells over.
-    Insert the new value in one of the two nodes.
-    Update parent or create a new parent.
-    */
-   void* old_node = get_page(cursor->table->pager, cursor->page_num);
-
-   uint32_t new_page_num = get_unused_page_num(cursor->table->pager);
-   void* new_node = get_page(cursor->table->pager, new_page_num);
-
-   initialize_leaf_node(new_node);
-
-   // Copy every cell into its new location
-   /**
-    * All existing keys plus new key should be divided
-    * evenly between old (left) and new (right) nodes.
-    * Starting from the right, move each key to correct position.
-    **/
-   for (uint32_t i = LEAF_NODE_MAX_CELLS; i >= 0; i--) {
-       void* destination_node;
-       if (i >= LEAF_NODE_SPLIT_COUNT) {
-           destination_node = new_node;
-       } else {
-           destination_node = old_node;
-       }
-
-       uint32_t index_within_node = i % LEAF_NODE_LEFT_SPLIT_COUNT;
-
-       void* destination = leaf_node_cell(destination_node, index_within_node);
-       
-       if (i == cursor->cell_num) {
-           serialize_row(value, destination);
-       } else if ( i > cursor->cell_num) {
-           memcpy(destination, leaf_node_cell(old_node, i - 1), LEAF_NODE_CELL_SIZE);
-       } else {
-           memcpy(destination, leaf_node_cell(old_node, i), LEAF_NODE_CELL_SIZE);
-       }
-       /* Update cell count on both leaf nodes */
-       *(leaf_node_num_cells(old_node)) = LEAF_NODE_LEFT_SPLIT_COUNT;
-       *(leaf_node_num_cells(new_node)) = LEAF_NODE_RIGHT_SPLIT_COUNT;
-
-       if(is_node_root(old_node)) {
-           return create_new_root(cursor->value, new_page_num);
-       } else {
-           printf("Need to implement updating parent after split.\n");
-           exit(EXIT_FAILURE);
-       }
-   }
-
-
-
-}
-
-void leaf_node_insert(Cursor* cursor, uint32_t key, Row* value) {
-    void* node = get_page(cursor->table->pager, cursor->page_num);
-
-    uint32_t num_cells = *leaf_node_num_cells(node);
+const char* server_execute_error(ExecuteResult result) {
+    switch (result) {
+        case (EXECUTE_DUPLICATE_KEY):
+            return "Error: Duplicate key.";
+        case (EXECUTE_TABLE_FULL):
+            return "Error: Table full.";
+        case (EXECUTE_INDEX_EXISTS):
+            return "Error: Index already exists.";
+        default:
+            return NULL;
+    }
+}
 
-    if (num_cells >= LEAF_NODE_MAX_CELLS) {
-        // Node full
-        leaf_node_split_and_insert(cursor, key, value);
+// Run one request and queue its reply
+void connection_run(Connection* connection, Table* table, const char* text, uint32_t length) {
+    InputBuffer input;
+    input.buffer = (char*) malloc(length + 1);
+    memcpy(input.buffer, text, length);
+    input.buffer[length] = '\0';
+    input.buffer_length = length + 1;
+    input.input_length = length;
+
+    if (input.buffer[0] == '.') {
+        free(input.buffer);
+        connection_reply_error(connection, "Meta commands are not served.");
         return;
     }
-
-    if (cursor->cell_num < num_cells) {
-        for(uint32_t i = num_cells; i > cursor->cell_num; i--) {
-            memcpy(leaf_node_cell(node, i), leaf_node_cell(node, i - 1),
-                    LEAF_NODE_CELL_SIZE);
+    Statement statement;
+    PrepareResult prepare_result = prepare_statement(&input, &statement);
+    free(input.buffer);
+    if (prepare_result != PREPARE_SUCCESS) {
+        free_statement(&statement);
+        connection_reply_error(connection, server_prepare_error(prepare_result));
+        return;
+    }
+    if (statement.num_params > 0) {
+        connection_reply_error(connection, "Cannot execute statement with unbound '?'.");
+    } else if (statement.type == STATEMENT_SELECT) {
+        RowsReply reply;
+        ResultSink* rows = connection_reply_rows_begin(connection, &reply);
+        table_begin_read(table);
+        select_rows(&statement, table, rows);
+        table_end_read(table);
+        connection_reply_rows_end(connection, &reply, rows);
+    } else {
+        const char* error = server_execute_error(execute_statement(&statement, table));
+        if (error != NULL) {
+            connection_reply_error(connection, error);
+        } else {
+            connection_reply(connection, SERVER_OK, "", 0);
         }
     }
-    *(leaf_node_num_cells(node)) += 1;
-    *(leaf_node_key(node, cursor->cell_num)) = key;
-    serialize_row(value, leaf_node_value(node, cursor->cell_num));
+    free_statement(&statement);
 }
 
-void print_leaf_node(void* node) {
-    uint32_t num_cells = *leaf_node_num_cells(node);
-    printf("leaf (size %d)\n", num_cells);
-    for (uint32_t i = 0; i < num_cells; i++) {
-        uint32_t key = *leaf_node_key(node, i);
-        printf("  - %d  :  %d\n", i, key);
+// Whether a request starts at offset and has been received in full
+bool connection_has_request(Connection* connection, uint32_t offset) {
+    if (connection->input_length - offset < sizeof(uint32_t)) {
+        return false;
     }
+    uint32_t length;
+    memcpy(&length, connection->input + offset, sizeof(uint32_t));
+    return length > SERVER_MAX_REQUEST || connection->input_length - offset - sizeof(uint32_t) >= length;
 }
 
-/**
- * db methods
- * */
-Table* db_open(const char* filename) {
-    Pager* pager = pager_open(filename);
+// Run the requests received in full, while the replies waiting are few enough
+void connection_run_requests(Connection* connection, Table* table) {
+    uint32_t offset = 0;
+    while (connection_has_request(connection, offset) &&
+           connection->output_length - connection->output_sent < SERVER_MAX_PENDING) {
+        uint32_t length;
+        memcpy(&length, connection->input + offset, sizeof(uint32_t));
+        if (length > SERVER_MAX_REQUEST) {
+            // Nothing after it can be trusted to start a request
+            connection_reply_error(connection, "Request is too long.");
+            connection->closing = true;
+            offset = connection->input_length;
+            break;
+        }
+        connection_run(connection, table, connection->input + offset + sizeof(uint32_t), length);
+        offset += sizeof(uint32_t) + length;
+    }
+    memmove(connection->input, connection->input + offset, connection->input_length - offset);
+    connection->input_length -= offset;
+}
 
-    Table* table = (Table*)malloc(sizeof(Table));
-    table->pager = pager;
-    table->root_page_num = 0;
+// Read what the client sent so far. Returns false once it has hung up.
+bool connection_read(Connection* connection) {
+    while (true) {
+        if (connection->input_capacity - connection->input_length < SERVER_READ_SIZE) {
+            connection->input_capacity = connection->input_length + SERVER_READ_SIZE;
+            connection->input = (char*) realloc(connection->input, connection->input_capacity);
+        }
+        ssize_t bytes = read(connection->fd, connection->input + connection->input_length,
+                             connection->input_capacity - connection->input_length);
+        if (bytes > 0) {
+            connection->input_length += bytes;
+            if (connection->input_length >= sizeof(uint32_t) + SERVER_MAX_REQUEST) {
+                // A request is in for sure, the rest can wait
+                return true;
+            }
+            continue;
+        }
+        if (bytes == -1 && errno == EINTR) {
+            continue;
+        }
+        return bytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK);
+    }
+}
 
-    if (pager->num_pages == 0) {
-        // New database file. Initialize page 0 as leaf node.
-        void* root_node = get_page(pager, 0);
-        initialize_leaf_node(root_node);
+// Send replies until the socket is full. Returns false when the client is gone.
+bool connection_write(Connection* connection) {
+    while (connection->output_sent < connection->output_length) {
+        ssize_t bytes = send(connection->fd, connection->output + connection->output_sent,
+                             connection->output_length - connection->output_sent, MSG_NOSIGNAL);
+        if (bytes == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        connection->output_sent += bytes;
     }
-    
-    return table;
+    connection->output_length = 0;
+    connection->output_sent = 0;
+    return true;
 }
 
-void db_close(Table* table) {
-    Pager* pager = table->pager;
+void connection_close(Server* server, Connection* connection) {
+    if (connection->prev != NULL) {
+        connection->prev->next = connection->next;
+    } else {
+        server->connections = connection->next;
+    }
+    if (connection->next != NULL) {
+        connection->next->prev = connection->prev;
+    }
+    epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, connection->fd, NULL);
+    close(connection->fd);
+    free(connection->input);
+    free(connection->output);
+    free(connection);
+}
 
-    for (uint32_t i = 0; i < pager->num_pages; i++) {
-        if (pager->pages[i] == NULL) {
-            continue;
+void server_accept(Server* server) {
+    while (true) {
+        int fd = accept(server->listen_fd, NULL, NULL);
+        if (fd == -1) {
+            // EAGAIN once every pending connection is taken
+            return;
         }
-        pager_flush(pager, i);
-        free(pager->pages[i]);
-        pager->pages[i] = NULL;
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        int no_delay = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &no_delay, sizeof(no_delay));
+
+        Connection* connection = (Connection*) malloc(sizeof(Connection));
+        connection->fd = fd;
+        connection->input = NULL;
+        connection->input_length = 0;
+        connection->input_capacity = 0;
+        connection->output_capacity = SERVER_READ_SIZE;
+        connection->output = (char*) malloc(connection->output_capacity);
+        connection->output_length = 0;
+        connection->output_sent = 0;
+        connection->events = EPOLLIN;
+        connection->closing = false;
+        connection->prev = NULL;
+        connection->next = server->connections;
+        if (server->connections != NULL) {
+            server->connections->prev = connection;
+        }
+        server->connections = connection;
+        struct epoll_event event;
+        event.events = connection->events;
+        event.data.ptr = connection;
+        epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, fd, &event);
     }
+}
 
-    int res = close(pager->file_descriptor);
-    if (res == -1) {
-        printf("Error closing db file.\n");
-        exit(EXIT_FAILURE);
+/**
+ * Handle whatever epoll reported for a connection: read, run the requests
+ * complete so far, and send the replies. Requests wait while too many replies
+ * are queued, and reading stops, so a client that sends without reading is
+ * held back.
+ **/
+void connection_serve(Server* server, Connection* connection, uint32_t events) {
+    if (events & EPOLLERR) {
+        connection_close(server, connection);
+        return;
+    }
+    if ((events & (EPOLLIN | EPOLLHUP)) && !connection->closing && !connection_read(connection)) {
+        // Requests already in are still answered
+        connection->closing = true;
     }
+    do {
+        connection_run_requests(connection, server->table);
+        if (!connection_write(connection)) {
+            connection_close(server, connection);
+            return;
+        }
+    } while (connection->output_length == 0 && connection_has_request(connection, 0));
+
+    bool pending = connection->output_length > 0;
+    if (connection->closing && !pending) {
+        connection_close(server, connection);
+        return;
+    }
+    uint32_t wanted = (pending ? (uint32_t)EPOLLOUT : 0) |
+                      (!connection->closing && connection->output_length - connection->output_sent < SERVER_MAX_PENDING
+                       ? (uint32_t)EPOLLIN : 0);
+    if (wanted != connection->events) {
+        connection->events = wanted;
+        struct epoll_event event;
+        event.events = wanted;
+        event.data.ptr = connection;
+        epoll_ctl(server->epoll_fd, EPOLL_CTL_MOD, connection->fd, &event);
+    }
+}
 
-    for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) {
-        void* page = pager->pages[i];
-        if (page) {
-            free(page);
-            pager->pages[i] = NULL;
+/**
+ * Serve the table at address until SIGINT or SIGTERM. Connections still open
+ * then are dropped, and the caller closes the table as usual.
+ **/
+void run_server(Table* table, const char* address) {
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = server_stop;
+    // No SA_RESTART, so epoll_wait returns to see the flag
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    Server server;
+    server.table = table;
+    server.listen_fd = server_listen(address);
+    server.epoll_fd = epoll_create1(0);
+    server.connections = NULL;
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+    epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, server.listen_fd, &event);
+    printf("Listening on %s\n", address);
+    fflush(stdout);
+
+    struct epoll_event events[SERVER_MAX_EVENTS];
+    while (!server_stopping) {
+        int count = epoll_wait(server.epoll_fd, events, SERVER_MAX_EVENTS, -1);
+        if (count == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            printf("Error waiting for connections: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i < count; i++) {
+            if (events[i].data.ptr == NULL) {
+                server_accept(&server);
+            } else {
+                connection_serve(&server, (Connection*)events[i].data.ptr, events[i].events);
+            }
         }
     }
-    free(pager);
+    while (server.connections != NULL) {
+        connection_close(&server, server.connections);
+    }
+    close(server.epoll_fd);
+    close(server.listen_fd);
+    if (!server_is_port(address)) {
+        unlink(address);
+    }
 }
 
 /**
- * Input
- * */
-InputBuffer* new_input_buffer() {
-    InputBuffer* input_buffer = (InputBuffer*)malloc(sizeof(InputBuffer));
-    input_buffer->buffer = NULL;
-    input_buffer->buffer_length = 0;
-    input_buffer->input_length = 0;
-    return input_buffer;
+ * Benchmark
+ * -bench N fills a new database through the engine's own calls, without the
+ * statement parser, and times each step:
+ *   sequential insert  N rows with the even ids 2, 4, ..., 2N, in order
+ *   random insert      N rows with the odd ids between them, shuffled
+ *   point lookup       N table_find calls on random ids
+ *   full scan          BENCH_SCANS passes of cursor_advance over every row
+ * Each step reports operations per second (rows for scans), the median and
+ * 99th percentile latency of an operation (of a whole pass for scans), the
+ * pages read from and written to the db file, and how much the heap grew.
+ * Options as -frames, -mmap or -page-size apply as usual.
+ **/
+typedef struct {
+    const char* name;
+    uint64_t* latencies;    // nanoseconds an operation took
+    uint32_t num_latencies;
+    uint64_t ops;
+    uint64_t start_nsec;
+    uint64_t pages_read;
+    uint64_t pages_written;
+    size_t heap_bytes;
+} BenchPhase;
+
+uint64_t now_nsec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
-void print_prompt() {
-    printf("db > ");
+size_t bench_heap_bytes() {
+    struct mallinfo2 info = mallinfo2();
+    return info.uordblks + info.hblkhd;
 }
 
-void read_input(InputBuffer* input_buffer) {
-    ssize_t bytes_read = 
-                  getline(&(input_buffer->buffer), &(input_buffer->buffer_length), stdin);
-    if (bytes_read <= 0) {
-        printf("Error reading input.\n");
-        exit(EXIT_FAILURE);
-    }
+// xorshift64*, so every run uses the same ids
+uint32_t bench_random(uint64_t* state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return (uint32_t)((*state * 2685821657736338717ULL) >> 32);
+}
 
-    input_buffer->input_length = bytes_read - 1;
-    input_buffer->buffer[bytes_read - 1] = 0;
+int compare_latencies(const void* a, const void* b) {
+    uint64_t latency_a = *(const uint64_t*)a;
+    uint64_t latency_b = *(const uint64_t*)b;
+    return (latency_a > latency_b) - (latency_a < latency_b);
 }
 
-void close_input_buffer(InputBuffer* input_buffer) {
-    free(input_buffer->buffer);
-    free(input_buffer);
+void bench_begin(BenchPhase* phase, const char* name, Table* table, uint64_t* latencies) {
+    phase->name = name;
+    phase->latencies = latencies;
+    phase->num_latencies = 0;
+    phase->ops = 0;
+    phase->pages_read = stats_get(&table->pager->stats.pages_read);
+    phase->pages_written = stats_get(&table->pager->stats.pages_written);
+    phase->heap_bytes = bench_heap_bytes();
+    phase->start_nsec = now_nsec();
 }
 
-/**
- * Meta commands
- * */
+void bench_record(BenchPhase* phase, uint64_t start_nsec, uint64_t ops) {
+    phase->latencies[phase->num_latencies++] = now_nsec() - start_nsec;
+    phase->ops += ops;
+}
 
-void print_constants() {
-    printf("ROW_SIZE: %d\n", ROW_SIZE);
-    printf("COMMON_NODE_HEADER_SIZE: %d\n", COMMON_NODE_HEADER_SIZE);
-    printf("LEAF_NODE_HEADER_SIZE: %d\n", LEAF_NODE_HEADER_SIZE);
-    printf("LEAF_NODE_CELL_SIZE: %d\n", LEAF_NODE_CELL_SIZE);
-    printf("LEAF_NODE_SPACE_FOR_CELLS: %d\n", LEAF_NODE_SPACE_FOR_CELLS);
-    printf("LEAF_NODE_MAX_CELLS: %d\n", LEAF_NODE_MAX_CELLS);
+void bench_end(BenchPhase* phase, Table* table) {
+    uint64_t elapsed_nsec = now_nsec() - phase->start_nsec;
+    long long heap_growth = (long long)bench_heap_bytes() - (long long)phase->heap_bytes;
+    uint64_t* latencies = phase->latencies;
+    uint32_t count = phase->num_latencies;
+    qsort(latencies, count, sizeof(uint64_t), compare_latencies);
+    printf("%-18s %10llu %12.0f %10.1f %10.1f %11llu %14llu %14lld\n", phase->name,
+           (unsigned long long)phase->ops, phase->ops * 1e9 / (elapsed_nsec > 0 ? elapsed_nsec : 1),
+           latencies[(count - 1) * 50 / 100] / 1e3, latencies[(count - 1) * 99 / 100] / 1e3,
+           (unsigned long long)(stats_get(&table->pager->stats.pages_read) - phase->pages_read),
+           (unsigned long long)(stats_get(&table->pager->stats.pages_written) - phase->pages_written),
+           heap_growth);
 }
 
-MetaCommandResult do_meta_command(InputBuffer* input_buffer, Table* table) {
-    if(strcmp(input_buffer->buffer, ".exit") == 0) {
-        db_close(table);
-        exit(EXIT_SUCCESS);
-    } else if(strcmp(input_buffer->buffer, ".btree") == 0) {
-        printf("Tree: \n");
-        print_leaf_node(get_page(table->pager, 0));
-        return META_COMMAND_SUCCESS;
-    } else if(strcmp(input_buffer->buffer, ".constants") == 0) {
-        printf("Constants:\n");
-        print_constants();
-        return META_COMMAND_SUCCESS;
-    } else {
-        return META_COMMAND_UNRECOGNIZED_COMMAND;
+void bench_insert(Table* table, uint32_t id) {
+    Statement statement;
+    memset(&statement, 0, sizeof(Statement));
+    statement.type = STATEMENT_INSERT;
+    statement.row_to_insert.id = id;
+    snprintf(statement.row_to_insert.username, sizeof(statement.row_to_insert.username), "user%u", id);
+    snprintf(statement.row_to_insert.email, sizeof(statement.row_to_insert.email), "user%u@example.com", id);
+    statement.rows_to_insert = &statement.row_to_insert;
+    statement.num_rows = 1;
+    if (execute_statement(&statement, table) != EXECUTE_SUCCESS) {
+        printf("Bench insert of id %u failed.\n", id);
+        exit(EXIT_FAILURE);
     }
 }
-/**
- * Statement
- * If the string it’s reading is larger than the buffer it’s reading into, 
- * it will cause a buffer overflow and start writing into unexpected places. 
- * We want to check the length of each string before we copy it into a Row structure. 
- * And to do that, we need to divide the input by spaces.
-*/
-
-PrepareResult prepare_insert(InputBuffer* input_buffer, Statement* statement) {
-    statement->type = STATEMENT_INSERT;
 
-    char* keyword   = strtok(input_buffer->buffer, " ");
-    char* id_string = strtok(NULL, " ");
-    char* username  = strtok(NULL, " ");
-    char* email     = strtok(NULL, " ");
-    if(id_string == NULL || username == NULL || email == NULL) {
-        return PREPARE_SYNTAX_ERROR;
-    }
-    int id = atoi(id_string);
-    if (id < 0) return PREPARE_NEGATIVE_ID;
-    if (strlen(username) > COLUMN_USERNAME_SIZE) {
-        return PREPARE_STRING_TOO_LONG;
-    }
-    if(strlen(email) > COLUMN_EMAIL_SIZE) {
-        return PREPARE_STRING_TOO_LONG;
+void run_bench(Table* table, uint32_t num_rows) {
+    // A latency per row, or per pass of the scan phase when there are fewer rows
+    uint32_t max_latencies = num_rows > BENCH_SCANS ? num_rows : BENCH_SCANS;
+    uint64_t* latencies = (uint64_t*) malloc(sizeof(uint64_t) * max_latencies);
+    uint32_t* ids = (uint32_t*) malloc(sizeof(uint32_t) * num_rows);
+    uint64_t random_state = 0x9E3779B97F4A7C15ULL;
+    BenchPhase phase;
+    printf("%-18s %10s %12s %10s %10s %11s %14s %14s\n", "phase", "ops", "ops/sec", "p50 us", "p99 us",
+           "pages read", "pages written", "heap growth");
+
+    bench_begin(&phase, "sequential insert", table, latencies);
+    for (uint32_t i = 1; i <= num_rows; i++) {
+        uint64_t start = now_nsec();
+        bench_insert(table, 2 * i);
+        bench_record(&phase, start, 1);
     }
+    bench_end(&phase, table);
 
-    statement->row_to_insert.id = id;
-    // printf("fuck !!! %s\n", email);
-    strcpy(statement->row_to_insert.username, username);
-    strcpy(statement->row_to_insert.email,    email);
-    return PREPARE_SUCCESS;
-}
-PrepareResult prepare_statement(InputBuffer* input_buffer, Statement* statement) {
-    if (strncmp(input_buffer->buffer, "insert", 6) == 0) {
-        return prepare_insert(input_buffer, statement);
+    for (uint32_t i = 0; i < num_rows; i++) {
+        ids[i] = 2 * i + 1;
     }
-    if (strcmp(input_buffer->buffer, "select") == 0) {
-        statement->type = STATEMENT_SELECT;
-        return PREPARE_SUCCESS;
+    for (uint32_t i = num_rows - 1; i > 0; i--) {
+        uint32_t j = bench_random(&random_state) % (i + 1);
+        uint32_t id = ids[i];
+        ids[i] = ids[j];
+        ids[j] = id;
     }
-    return PREPARE_UNRECOGNIZED_STATEMENT;
-}
-
-/**
- * Exuecute statements
- * */
-ExecuteResult execute_insert(Statement* statement, Table* table) {
-
-    void* node = get_page(table->pager, table->root_page_num);
-    uint32_t num_cells = (*leaf_node_num_cells(node));
-
-    Row* row_to_insert = &(statement->row_to_insert);
-    uint16_t key_to_insert = row_to_insert->id;
-    Cursor* cursor = table_find(table, key_to_insert);
-
-    if (cursor->cell_num < num_cells) {
-        uint32_t key_at_index = *leaf_node_key(node, cursor->cell_num);
-        if (key_at_index == key_to_insert) {
-            return EXECUTE_DUPLICATE_KEY;
+    bench_begin(&phase, "random insert", table, latencies);
+    for (uint32_t i = 0; i < num_rows; i++) {
+        uint64_t start = now_nsec();
+        bench_insert(table, ids[i]);
+        bench_record(&phase, start, 1);
+    }
+    bench_end(&phase, table);
+
+    bench_begin(&phase, "point lookup", table, latencies);
+    for (uint32_t i = 0; i < num_rows; i++) {
+        uint32_t id = bench_random(&random_state) % (2 * num_rows) + 1;
+        uint64_t start = now_nsec();
+        table_begin_read(table);
+        Cursor* cursor = table_find(table, id);
+        bool found = cursor->cell_num < *leaf_node_num_cells(cursor->node) && cursor_key(cursor) == id;
+        cursor_close(cursor);
+        table_end_read(table);
+        bench_record(&phase, start, 1);
+        if (!found) {
+            printf("Bench lookup did not find id %u.\n", id);
+            exit(EXIT_FAILURE);
         }
     }
-
-    leaf_node_insert(cursor, row_to_insert->id, row_to_insert);
-    
-    free(cursor);
-
-    return EXECUTE_SUCCESS;
-}
-
-ExecuteResult execute_select(Statement* statement, Table* table) {
-    Cursor* cursor = table_start(table);
-
-    Row row;
-    while(!(cursor->end_of_table)) {
-        deserialize_row(cursor_value(cursor), &row);
-        print_row(&row);
-        cursor_advance(cursor);
+    bench_end(&phase, table);
+
+    bench_begin(&phase, "full scan", table, latencies);
+    for (uint32_t pass = 0; pass < BENCH_SCANS; pass++) {
+        uint64_t start = now_nsec();
+        uint64_t rows = 0;
+        table_begin_read(table);
+        Cursor* cursor = table_start(table);
+        while (!cursor->end_of_table) {
+            RowView row;
+            cursor_view(cursor, &row);
+            rows += row.username_length > 0;
+            cursor_advance(cursor);
+        }
+        cursor_close(cursor);
+        table_end_read(table);
+        bench_record(&phase, start, rows);
+        if (rows != 2 * (uint64_t)num_rows) {
+            printf("Bench scan saw %llu of %u rows.\n", (unsigned long long)rows, 2 * num_rows);
+            exit(EXIT_FAILURE);
+        }
     }
-    free(cursor);
+    bench_end(&phase, table);
 
-    return EXECUTE_SUCCESS;
+    free(ids);
+    free(latencies);
 }
 
-ExecuteResult execute_statement(Statement* statement, Table* table) {
-    switch (statement->type) {
-        case (STATEMENT_INSERT):
-            return execute_insert(statement, table);
-        case (STATEMENT_SELECT):
-            return execute_select(statement, table);
+// The value of a numeric option, which has to be a whole number from min to max
+uint32_t parse_option_number(const char* option, const char* value, uint32_t min, uint32_t max) {
+    char* end;
+    errno = 0;
+    unsigned long number = strtoul(value, &end, 10);
+    if (value[0] < '0' || value[0] > '9' || *end != '\0' || errno == ERANGE || number < min || number > max) {
+        printf("%s needs a number from %u to %u.\n", option, min, max);
+        exit(EXIT_FAILURE);
     }
+    return (uint32_t)number;
 }
 
-/**
- * main
- * */
 int main(int argc, char* argv[]) {
     if (argc < 2) {
         printf("Must supply a database filename.\n");
         exit(EXIT_FAILURE);
     }
     char* filename = argv[1];
-    Table* table = db_open(filename);
+    PagerConfig config;
+    config.num_frames = DEFAULT_POOL_FRAMES;
+    config.page_size = DEFAULT_PAGE_SIZE;
+    config.use_mmap = false;
+    config.use_wal = true;
+    config.wal_group_commit = WAL_GROUP_COMMIT;
+    config.readahead_pages = DEFAULT_READAHEAD_PAGES;
+    bool batch = false;
+    uint32_t scan_threads = DEFAULT_SCAN_THREADS;
+    const char* server_address = NULL;   // a port or a socket path, see "Server"
+    uint32_t bench_rows = 0;             // see "Benchmark"
+
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "-frames") == 0 && i + 1 < argc) {
+            config.num_frames = parse_option_number("-frames", argv[++i], MIN_POOL_FRAMES, MAX_POOL_FRAMES);
+        } else if (strcmp(argv[i], "-page-size") == 0 && i + 1 < argc) {
+            config.page_size = parse_option_number("-page-size", argv[++i], MIN_PAGE_SIZE, MAX_PAGE_SIZE);
+            if (!page_size_is_valid(config.page_size)) {
+                printf("-page-size needs a power of two from %d to %d.\n", MIN_PAGE_SIZE, MAX_PAGE_SIZE);
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(argv[i], "-mmap") == 0) {
+            config.use_mmap = true;
+        } else if (strcmp(argv[i], "-nowal") == 0) {
+            config.use_wal = false;
+        } else if (strcmp(argv[i], "-group-commit") == 0 && i + 1 < argc) {
+            config.wal_group_commit = parse_option_number("-group-commit", argv[++i], 1, MAX_WAL_GROUP_COMMIT);
+        } else if (strcmp(argv[i], "-readahead") == 0 && i + 1 < argc) {
+            config.readahead_pages = parse_option_number("-readahead", argv[++i], 0, MAX_READAHEAD_PAGES);
+        } else if (strcmp(argv[i], "-batch") == 0) {
+            batch = true;
+        } else if (strcmp(argv[i], "-scan-threads") == 0 && i + 1 < argc) {
+            scan_threads = parse_option_number("-scan-threads", argv[++i], 1, MAX_SCAN_THREADS);
+        } else if (strcmp(argv[i], "-server") == 0 && i + 1 < argc) {
+            server_address = argv[++i];
+        } else if (strcmp(argv[i], "-bench") == 0 && i + 1 < argc) {
+            bench_rows = parse_option_number("-bench", argv[++i], 1, INT32_MAX / 2);
+        } else {
+            printf("Unrecognized option '%s'\n", argv[i]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (bench_rows > 0 && access(filename, F_OK) == 0) {
+        printf("-bench needs a db file that does not exist yet.\n");
+        exit(EXIT_FAILURE);
+    }
+    Table* table = db_open(filename, &config);
+    table->scan_threads = scan_threads;
+    if (bench_rows > 0) {
+        run_bench(table, bench_rows);
+        db_close(table);
+        return EXIT_SUCCESS;
+    }
+    if (server_address != NULL) {
+        run_server(table, server_address);
+        db_close(table);
+        return EXIT_SUCCESS;
+    }
     InputBuffer* input_buffer = new_input_buffer();
+    // -batch runs a script from standard input: no prompt and no "Executed."
+    BatchReader* reader = NULL;
+    if (batch) {
+        reader = batch_reader_open(STDIN_FILENO);
+        table->commit_interval = BATCH_COMMIT_STATEMENTS;
+    }
 
     while(true) {
-        print_prompt();
-
-        read_input(input_buffer);
+        if (batch) {
+            if (!batch_read_input(reader, input_buffer)) {
+                break;
+            }
+        } else {
+            print_prompt();
+            read_input(input_buffer);
+        }
 
         if(input_buffer->buffer[0] == '.') {
             switch(do_meta_command(input_buffer, table)) {
@@ -825,9 +6814,17 @@ int main(int argc, char* argv[]) {
                         input_buffer->buffer);
                 continue;
         }
+        if (statement.num_params > 0) {
+            // Placeholders are only bound through db_prepare/db_step.
+            printf("Cannot execute statement with unbound '?'.\n");
+            free_statement(&statement);
+            continue;
+        }
         switch(execute_statement(&statement, table)) {
             case (EXECUTE_SUCCESS):
-                printf("Executed.\n");
+                if (!batch) {
+                    printf("Executed.\n");
+                }
                 break;
             case (EXECUTE_DUPLICATE_KEY):
                 printf("Error: Duplicate key.\n");
@@ -835,7 +6832,17 @@ int main(int argc, char* argv[]) {
             case (EXECUTE_TABLE_FULL):
                 printf("Error: Table full.\n");
                 break;
+            case (EXECUTE_INDEX_EXISTS):
+                printf("Error: Index already exists.\n");
+                break;
         }
+        free_statement(&statement);
     }
+
+    // End of the script. The buffer points into the reader's chunk.
+    batch_reader_close(reader);
+    free(input_buffer);
+    db_close(table);
+    return EXIT_SUCCESS;
 }
 